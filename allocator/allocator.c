@@ -7,6 +7,10 @@
 
 #include "quantum.h"
 
+#if ALLOC_N_CORES > 1
+#    include <ch.h>
+#endif
+
 #ifdef ALLOCATOR_DEBUG
 #    include "quantum/logging/debug.h"
 #    define allocator_dprintf dprintf
@@ -14,95 +18,618 @@
 #    define allocator_dprintf(...)
 #endif
 
-static struct {
+// sentinel for an empty bucket in the index
+#define INDEX_EMPTY (0)
+
+typedef struct {
     struct {
         const allocator_t *ptr[ALLOC_ALLOCATORS_SIZE];
+        size_t             used[ALLOC_ALLOCATORS_SIZE];
+        size_t             peak[ALLOC_ALLOCATORS_SIZE];
         size_t             count;
     } ators;
 
     struct {
         alloc_stats_t ptr[ALLOC_ALLOCATIONS_SIZE];
         size_t        count;
+        size_t        used;
+        size_t        peak;
+
+        // slots whose allocation was free'd, to be recycled
+        uint16_t free[ALLOC_ALLOCATIONS_SIZE];
+        size_t   n_free;
+
+        // open-addressing (linear probing) table, mapping pointers to slots
+        // values are stored as `slot + 1`, so that 0 means empty
+        uint16_t index[ALLOC_INDEX_SIZE];
+
+        // call site of each allocation, ALLOC_SITES_SIZE if not tracked
+        uint8_t site[ALLOC_ALLOCATIONS_SIZE];
     } stats;
-} alloc = {0};
+
+    struct {
+        alloc_site_t ptr[ALLOC_SITES_SIZE];
+        size_t       count;
+    } sites;
+
+#if defined(ALLOC_TRACE_ENABLE)
+    struct {
+        alloc_trace_event_t events[ALLOC_TRACE_SIZE];
+
+        // head is only written by the core owning this state, tail by the one draining it
+        uint32_t head;
+        uint32_t tail;
+
+        // events lost due to the buffer being full, and how many of them have been reported
+        uint32_t dropped;
+        uint32_t reported;
+
+        // allocators whose name has been printed already
+        size_t announced;
+    } trace;
+#endif
+
+#if ALLOC_N_CORES > 1
+    // allocations tracked by this core which another one free'd, as `remote[freeing_core]`
+    per_core_queue_t remote[ALLOC_N_CORES];
+#endif
+} alloc_state_t;
+
+// each core keeps its own bookkeeping, so that no locking is needed
+static alloc_state_t alloc_states[ALLOC_N_CORES] = {0};
+
+static inline uint8_t current_core(void) {
+#if ALLOC_N_CORES > 1
+    return port_get_core_id();
+#else
+    return 0;
+#endif
+}
+
+static inline alloc_state_t *local_alloc(void) {
+    return &alloc_states[current_core()];
+}
 
 const allocator_t *const *get_known_allocators(size_t *n) {
-    *n = alloc.ators.count;
-    return alloc.ators.ptr;
+    const alloc_state_t *const alloc = local_alloc();
+
+    *n = alloc->ators.count;
+    return alloc->ators.ptr;
 }
 
+static void remote_free_drain(void);
+
 const alloc_stats_t *get_allocations(size_t *n) {
-    *n = alloc.stats.count;
-    return alloc.stats.ptr;
+    const alloc_state_t *const alloc = local_alloc();
+
+    // don't report blocks that another core already free'd
+    remote_free_drain();
+
+    *n = alloc->stats.count;
+    return alloc->stats.ptr;
+}
+
+const alloc_site_t *get_alloc_sites(size_t *n) {
+    const alloc_state_t *const alloc = local_alloc();
+
+    *n = alloc->sites.count;
+    return alloc->sites.ptr;
 }
 
 size_t get_used_heap(void) {
     size_t used = 0;
 
-    for (size_t i = 0; i < alloc.stats.count; ++i) {
-        const alloc_stats_t stat = alloc.stats.ptr[i];
+    for (size_t core = 0; core < ALLOC_N_CORES; ++core) {
+        used += alloc_states[core].stats.used;
+    }
+
+    return used;
+}
+
+size_t get_peak_heap(void) {
+    size_t peak = 0;
 
-        // lifetime.end == 0 -> not yet free'd
-        //
-        // without this, we sum up all space every allocated
-        if (stat.lifetime.end == 0) {
-            used += stat.size;
+    for (size_t core = 0; core < ALLOC_N_CORES; ++core) {
+        peak += alloc_states[core].stats.peak;
+    }
+
+    return peak;
+}
+
+// position of the allocator in `alloc->ators`, ALLOC_ALLOCATORS_SIZE if not found
+static size_t get_allocator_index(const alloc_state_t *alloc, const allocator_t *allocator) {
+    for (size_t i = 0; i < alloc->ators.count; ++i) {
+        if (alloc->ators.ptr[i] == allocator) {
+            return i;
+        }
+    }
+
+    return ALLOC_ALLOCATORS_SIZE;
+}
+
+size_t get_used_heap_by(const allocator_t *allocator) {
+    size_t used = 0;
+
+    for (size_t core = 0; core < ALLOC_N_CORES; ++core) {
+        const alloc_state_t *const alloc = &alloc_states[core];
+
+        const size_t index = get_allocator_index(alloc, allocator);
+        if (index != ALLOC_ALLOCATORS_SIZE) {
+            used += alloc->ators.used[index];
         }
     }
 
     return used;
 }
 
-static alloc_stats_t *get_stats(void *ptr) {
-    for (size_t i = 0; i < ARRAY_SIZE(alloc.stats.ptr); ++i) {
-        alloc_stats_t *stat = &alloc.stats.ptr[i];
+size_t get_peak_heap_by(const allocator_t *allocator) {
+    size_t peak = 0;
 
-        if (stat->ptr == ptr) {
-            return stat;
+    for (size_t core = 0; core < ALLOC_N_CORES; ++core) {
+        const alloc_state_t *const alloc = &alloc_states[core];
+
+        const size_t index = get_allocator_index(alloc, allocator);
+        if (index != ALLOC_ALLOCATORS_SIZE) {
+            peak += alloc->ators.peak[index];
         }
     }
 
-    return NULL;
+    return peak;
 }
 
-static void push_new_stat(const allocator_t *allocator, void *ptr, size_t size) {
-    if (ptr == NULL) {
+// keep track of the bytes being used (and its high-water mark), both globally and per-allocator
+static void update_used(const allocator_t *allocator, size_t add, size_t sub) {
+    alloc_state_t *const alloc = local_alloc();
+
+    alloc->stats.used += add;
+    alloc->stats.used -= sub;
+    alloc->stats.peak = MAX(alloc->stats.peak, alloc->stats.used);
+
+    const size_t index = get_allocator_index(alloc, allocator);
+    if (index != ALLOC_ALLOCATORS_SIZE) {
+        alloc->ators.used[index] += add;
+        alloc->ators.used[index] -= sub;
+        alloc->ators.peak[index] = MAX(alloc->ators.peak[index], alloc->ators.used[index]);
+    }
+}
+
+#if defined(ALLOC_TRACE_ENABLE)
+static void trace_event(alloc_state_t *alloc, alloc_trace_op_t op, const allocator_t *allocator, const void *old_ptr, const void *ptr, size_t size) {
+    const uint32_t head = alloc->trace.head;
+    const uint32_t tail = __atomic_load_n(&alloc->trace.tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail >= ALLOC_TRACE_SIZE) {
+        alloc->trace.dropped++;
         return;
     }
 
-    bool allocator_found = false;
-    for (size_t i = 0; i > alloc.ators.count; ++i) {
-        const allocator_t *element = alloc.ators.ptr[i];
-        if (element == allocator) {
-            allocator_found = true;
+    alloc->trace.events[head % ALLOC_TRACE_SIZE] = (alloc_trace_event_t){
+        .timestamp = timer_read32(),
+        .old_ptr   = (uintptr_t)old_ptr,
+        .ptr       = (uintptr_t)ptr,
+        .size      = size,
+        .op        = op,
+        .allocator = get_allocator_index(alloc, allocator),
+    };
+
+    __atomic_store_n(&alloc->trace.head, head + 1, __ATOMIC_RELEASE);
+}
+#else
+#    define trace_event(...)
+#endif
+
+// position of the call site in `alloc->sites`, ALLOC_SITES_SIZE if not found (and no space to add it)
+static uint8_t get_site_index(alloc_state_t *alloc, const void *caller) {
+    for (uint8_t i = 0; i < alloc->sites.count; ++i) {
+        if (alloc->sites.ptr[i].caller == caller) {
+            return i;
+        }
+    }
+
+    if (alloc->sites.count >= ALLOC_SITES_SIZE) {
+        allocator_dprintf("[WARN]: Too many call sites, can't track\n");
+        return ALLOC_SITES_SIZE;
+    }
+
+    alloc->sites.ptr[alloc->sites.count] = (alloc_site_t){
+        .caller = caller,
+    };
+
+    return alloc->sites.count++;
+}
+
+// keep track of the bytes being used (and its high-water mark) by the call site of an allocation
+static void update_site(alloc_state_t *alloc, uint16_t slot, size_t add, size_t sub) {
+    const uint8_t index = alloc->stats.site[slot];
+    if (index == ALLOC_SITES_SIZE) {
+        return;
+    }
+
+    alloc_site_t *const site = &alloc->sites.ptr[index];
+
+    site->live += add;
+    site->live -= sub;
+    site->peak = MAX(site->peak, site->live);
+}
+
+static inline size_t index_home(const void *ptr) {
+    // low bits are (mostly) zero due to alignment, drop them before spreading with Knuth's multiplicative hash
+    const uint32_t hash = ((uint32_t)(uintptr_t)ptr >> 3) * 2654435761u;
+    return hash & (ALLOC_INDEX_SIZE - 1);
+}
+
+static inline size_t index_next(size_t bucket) {
+    return (bucket + 1) & (ALLOC_INDEX_SIZE - 1);
+}
+
+// find the bucket where `ptr` is stored, or the empty one where it would be inserted
+static size_t index_find(const void *ptr) {
+    alloc_state_t *const alloc = local_alloc();
+
+    size_t bucket = index_home(ptr);
+
+    while (alloc->stats.index[bucket] != INDEX_EMPTY) {
+        const alloc_stats_t *stat = &alloc->stats.ptr[alloc->stats.index[bucket] - 1];
+        if (stat->ptr == ptr) {
             break;
         }
+
+        bucket = index_next(bucket);
+    }
+
+    return bucket;
+}
+
+// backward-shift deletion, no tombstones are left behind, so lookups don't degrade over time
+static void index_remove(size_t bucket) {
+    alloc_state_t *const alloc = local_alloc();
+
+    size_t hole = bucket;
+
+    alloc->stats.index[hole] = INDEX_EMPTY;
+
+    size_t next = index_next(hole);
+    while (alloc->stats.index[next] != INDEX_EMPTY) {
+        const size_t home = index_home(alloc->stats.ptr[alloc->stats.index[next] - 1].ptr);
+
+        // can the element be moved into the hole without breaking its probe sequence?
+        const bool movable = (next > hole) ? (home <= hole || home > next) : (home <= hole && home > next);
+        if (movable) {
+            alloc->stats.index[hole] = alloc->stats.index[next];
+            alloc->stats.index[next] = INDEX_EMPTY;
+            hole                     = next;
+        }
+
+        next = index_next(next);
+    }
+}
+
+static alloc_stats_t *get_stats(void *ptr) {
+    alloc_state_t *const alloc = local_alloc();
+
+    const size_t bucket = index_find(ptr);
+
+    if (alloc->stats.index[bucket] == INDEX_EMPTY) {
+        return NULL;
+    }
+
+    return &alloc->stats.ptr[alloc->stats.index[bucket] - 1];
+}
+
+static void pop_stat(alloc_stats_t *stat);
+
+#if ALLOC_N_CORES > 1
+// flag the allocations that other cores free'd
+static void remote_free_drain(void) {
+    alloc_state_t *const alloc = local_alloc();
+
+    for (uint8_t other = 0; other < ALLOC_N_CORES; ++other) {
+        per_core_queue_t *const queue = &alloc->remote[other];
+
+        const uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+        uint32_t       tail = queue->tail;
+
+        while (tail != head) {
+            void *ptr = queue->ptr[tail & (ALLOC_PER_CORE_QUEUE_SIZE - 1)];
+            tail++;
+
+            // every other core is told, only the one that allocated it will find it
+            alloc_stats_t *stat = get_stats(ptr);
+            if (stat != NULL) {
+                pop_stat(stat);
+            }
+        }
+
+        __atomic_store_n(&queue->tail, tail, __ATOMIC_RELEASE);
     }
+}
+#else
+static void remote_free_drain(void) {}
+#endif
 
-    if (!allocator_found) {
-        if (alloc.ators.count >= ALLOC_ALLOCATORS_SIZE) {
+static void push_new_stat(const allocator_t *allocator, void *ptr, size_t size, const void *caller) {
+    alloc_state_t *const alloc = local_alloc();
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    // a free from another core may refer to this same address, handle it before tracking the new allocation
+    remote_free_drain();
+
+    if (get_allocator_index(alloc, allocator) == ALLOC_ALLOCATORS_SIZE) {
+        if (alloc->ators.count >= ALLOC_ALLOCATORS_SIZE) {
             allocator_dprintf("[WARN]: Too many allocators, can't track\n");
         } else {
-            alloc.ators.ptr[alloc.ators.count++] = allocator;
+            alloc->ators.ptr[alloc->ators.count++] = allocator;
         }
     }
 
-    if (alloc.stats.count >= ALLOC_ALLOCATIONS_SIZE) {
+    // address was given out again, without us seeing it being free'd, drop stale entry
+    alloc_stats_t *const stale = get_stats(ptr);
+    if (stale != NULL) {
+        allocator_dprintf("[WARN]: Pointer (%p) was already being tracked\n", ptr);
+        pop_stat(stale);
+    }
+
+    uint16_t slot;
+    if (alloc->stats.count < ALLOC_ALLOCATIONS_SIZE) {
+        slot = alloc->stats.count++;
+    } else if (alloc->stats.n_free > 0) {
+        slot = alloc->stats.free[--alloc->stats.n_free];
+    } else {
         allocator_dprintf("[WARN]: Too many stats, can't track\n");
+        return;
+    }
+
+    alloc->stats.ptr[slot] = (alloc_stats_t){
+        .allocator = allocator,
+        .ptr       = ptr,
+        .size      = size,
+        .lifetime =
+            {
+                .start = timer_read32(),
+                .end   = 0,
+            },
+        .caller = caller,
+    };
+
+    alloc->stats.index[index_find(ptr)] = slot + 1;
+
+    const uint8_t site      = get_site_index(alloc, caller);
+    alloc->stats.site[slot] = site;
+    if (site != ALLOC_SITES_SIZE) {
+        alloc->sites.ptr[site].count++;
+    }
+
+    update_used(allocator, size, 0);
+    update_site(alloc, slot, size, 0);
+
+    trace_event(alloc, ALLOC_TRACE_MALLOC, allocator, NULL, ptr, size);
+}
+
+// flag an allocation as free'd, and make its slot available again
+static void pop_stat(alloc_stats_t *stat) {
+    alloc_state_t *const alloc = local_alloc();
+
+    const uint16_t slot = stat - alloc->stats.ptr;
+
+    update_used(stat->allocator, 0, stat->size);
+    update_site(alloc, slot, 0, stat->size);
+    stat->lifetime.end = timer_read32();
+
+    const uint8_t site = alloc->stats.site[slot];
+    if (site != ALLOC_SITES_SIZE) {
+        alloc->sites.ptr[site].freed++;
+        alloc->sites.ptr[site].lifetime += stat->lifetime.end - stat->lifetime.start;
+    }
+
+    index_remove(index_find(stat->ptr));
+    alloc->stats.free[alloc->stats.n_free++] = slot;
+
+    trace_event(alloc, ALLOC_TRACE_FREE, stat->allocator, stat->ptr, NULL, stat->size);
+}
+
+// flag every live allocation of `allocator` within [start, end) as free'd
+static void release_stats_in(const allocator_t *allocator, const void *start, const void *end) {
+    alloc_state_t *const alloc = local_alloc();
+
+    for (size_t i = 0; i < alloc->stats.count; ++i) {
+        alloc_stats_t *stat = &alloc->stats.ptr[i];
+
+        if (stat->allocator != allocator || stat->lifetime.end != 0) {
+            continue;
+        }
+
+        if (start <= stat->ptr && stat->ptr < end) {
+            pop_stat(stat);
+        }
+    }
+}
+
+// an allocation changed its address and/or size
+static void move_stat(alloc_stats_t *stat, void *ptr, size_t size) {
+    alloc_state_t *const alloc = local_alloc();
+
+    const uint16_t slot = stat - alloc->stats.ptr;
+
+    update_used(stat->allocator, size, stat->size);
+    update_site(alloc, slot, size, stat->size);
+
+    index_remove(index_find(stat->ptr));
+
+    trace_event(alloc, ALLOC_TRACE_REALLOC, stat->allocator, stat->ptr, ptr, size);
+
+    stat->ptr  = ptr;
+    stat->size = size;
+
+    alloc->stats.index[index_find(ptr)] = slot + 1;
+}
+
+// space before each block of a per-core allocator, storing the core that allocated it
+// 8 bytes, to keep the alignment of the underlying allocator
+#define PER_CORE_HEADER (8)
+
+static inline uint8_t *per_core_header(void *ptr) {
+    return (uint8_t *)ptr - PER_CORE_HEADER;
+}
+
+// disable interrupts on the current core, so that another thread can't preempt a push to the same queue
+static inline uint32_t per_core_lock(void) {
+#if defined(PROTOCOL_CHIBIOS)
+    const uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    return primask;
+#else
+    return 0;
+#endif
+}
+
+static inline void per_core_unlock(__unused uint32_t primask) {
+#if defined(PROTOCOL_CHIBIOS)
+    __set_PRIMASK(primask);
+#endif
+}
+
+// queue a block to be free'd by the core that allocated it
+static bool per_core_push(per_core_queue_t *queue, void *ptr) {
+    const uint32_t primask = per_core_lock();
+
+    // head is only ever written by this core, tail is written by the owner
+    const uint32_t head = queue->head;
+    const uint32_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+
+    const bool full = head - tail >= ALLOC_PER_CORE_QUEUE_SIZE;
+    if (full) {
+        queue->dropped++;
     } else {
-        alloc.stats.ptr[alloc.stats.count++] = (alloc_stats_t){
-            .allocator = allocator,
-            .ptr       = ptr,
-            .size      = size,
-            .lifetime =
-                {
-                    .start = timer_read32(),
-                    .end   = 0,
-                },
-        };
+        queue->ptr[head & (ALLOC_PER_CORE_QUEUE_SIZE - 1)] = ptr;
+        __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    per_core_unlock(primask);
+    return !full;
+}
+
+#if ALLOC_N_CORES > 1
+// `ptr` is not tracked by this core, tell the others (which one allocated it is not known)
+static void remote_free(void *ptr) {
+    const uint8_t core = current_core();
+
+    for (uint8_t other = 0; other < ALLOC_N_CORES; ++other) {
+        if (other == core) {
+            continue;
+        }
+
+        if (!per_core_push(&alloc_states[other].remote[core], ptr)) {
+            allocator_dprintf("[WARN]: Stats queue for core %d is full, can't track free\n", other);
+        }
+    }
+}
+#endif
+
+// free the blocks that other cores gave back to this one
+static void per_core_drain(const allocator_t *allocator, uint8_t core) {
+    per_core_t *const        state   = (per_core_t *)allocator->arg;
+    const allocator_t *const backend = state->backends[core];
+
+    for (uint8_t other = 0; other < ALLOC_N_CORES; ++other) {
+        per_core_queue_t *const queue = &state->queues[core][other];
+
+        const uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+        uint32_t       tail = queue->tail;
+
+        while (tail != head) {
+            void *ptr = queue->ptr[tail & (ALLOC_PER_CORE_QUEUE_SIZE - 1)];
+            tail++;
+
+            backend->free(backend, per_core_header(ptr));
+
+            // allocation was tracked by this core, update its stats
+            alloc_stats_t *stat = get_stats(ptr);
+            if (stat != NULL) {
+                pop_stat(stat);
+            }
+        }
+
+        __atomic_store_n(&queue->tail, tail, __ATOMIC_RELEASE);
     }
 }
 
+static void per_core_free(const allocator_t *allocator, void *ptr) {
+    per_core_t *const state = (per_core_t *)allocator->arg;
+    const uint8_t     core  = current_core();
+    uint8_t *const    raw   = per_core_header(ptr);
+    const uint8_t     owner = *raw;
+
+    if (owner == core) {
+        const allocator_t *const backend = state->backends[core];
+        backend->free(backend, raw);
+
+        per_core_drain(allocator, core);
+        return;
+    }
+
+    if (!per_core_push(&state->queues[owner][core], ptr)) {
+        // nowhere to store it, leak the block rather than touching another core's allocator
+        allocator_dprintf("[ERROR] %s: queue for core %d is full\n", __func__, owner);
+    }
+}
+
+static void *per_core_malloc(const allocator_t *allocator, size_t size) {
+    per_core_t *const state = (per_core_t *)allocator->arg;
+    const uint8_t     core  = current_core();
+
+    per_core_drain(allocator, core);
+
+    const allocator_t *const backend = state->backends[core];
+
+    uint8_t *raw = backend->malloc(backend, size + PER_CORE_HEADER);
+    if (raw == NULL) {
+        return NULL;
+    }
+
+    *raw = core;
+    return raw + PER_CORE_HEADER;
+}
+
+static void *per_core_realloc(const allocator_t *allocator, void *ptr, size_t size) {
+    per_core_t *const state = (per_core_t *)allocator->arg;
+    const uint8_t     core  = current_core();
+    uint8_t *const    raw   = per_core_header(ptr);
+
+    if (*raw != core) {
+        allocator_dprintf("[ERROR] %s: can't realloc memory from another core\n", __func__);
+        return NULL;
+    }
+
+    const allocator_t *const backend = state->backends[core];
+
+    // header is preserved, as it is part of the contents being moved (if any)
+    uint8_t *new_raw = backend->realloc(backend, raw, size + PER_CORE_HEADER);
+    if (new_raw == NULL) {
+        return NULL;
+    }
+
+    return new_raw + PER_CORE_HEADER;
+}
+
+const allocator_t new_per_core_allocator(per_core_t *state, const char *name) {
+    // native realloc only if every backend provides it, generic fallback otherwise
+    bool can_realloc = true;
+    for (uint8_t core = 0; core < ALLOC_N_CORES; ++core) {
+        can_realloc &= state->backends[core]->realloc != NULL;
+    }
+
+    return (allocator_t){
+        .free    = per_core_free,
+        .malloc  = per_core_malloc,
+        .realloc = can_realloc ? per_core_realloc : NULL,
+        .name    = name,
+        .arg     = state,
+    };
+}
+
 // when wrapping stdlib:
 //   * `malloc(x)` gets translated to `__wrap_malloc(x)`
 //   * wrapper calls `malloc_with(c_runtime, x)`
@@ -131,31 +658,251 @@ extern void *__real_realloc(void *, size_t);
 #    define __realloc realloc
 #endif
 
-static void *calloc_shim(__unused const allocator_t *allocator, size_t nmemb, size_t size) {
-    return __calloc(nmemb, size);
+static void *calloc_shim(__unused const allocator_t *allocator, size_t nmemb, size_t size) {
+    return __calloc(nmemb, size);
+}
+
+static void free_shim(__unused const allocator_t *allocator, void *ptr) {
+    return __free(ptr);
+}
+
+static void *malloc_shim(__unused const allocator_t *allocator, size_t size) {
+    return __malloc(size);
+}
+
+static void *realloc_shim(__unused const allocator_t *allocator, void *ptr, size_t size) {
+    return __realloc(ptr, size);
+}
+
+const allocator_t _c_runtime_allocator = {
+    .calloc  = calloc_shim,
+    .free    = free_shim,
+    .malloc  = malloc_shim,
+    .realloc = realloc_shim,
+    .name    = "std",
+};
+
+const allocator_t *const c_runtime_allocator = &_c_runtime_allocator;
+
+// size class able to hold `size` bytes, ALLOC_SLAB_N_CLASSES if too big
+static uint8_t slab_class(size_t size) {
+    if (size <= (1 << ALLOC_SLAB_MIN_SHIFT)) {
+        return 0;
+    }
+
+    // ceil(log2(size))
+    const uint8_t shift = 32 - __builtin_clz((uint32_t)size - 1);
+    if (shift > ALLOC_SLAB_MAX_SHIFT) {
+        return ALLOC_SLAB_N_CLASSES;
+    }
+
+    return shift - ALLOC_SLAB_MIN_SHIFT;
+}
+
+static inline size_t slab_class_size(uint8_t class) {
+    return 1 << (class + ALLOC_SLAB_MIN_SHIFT);
+}
+
+// size class of the page containing `ptr`, ALLOC_SLAB_N_CLASSES if not from this slab
+static uint8_t slab_ptr_class(const slab_t *slab, const void *ptr) {
+    const uint8_t *byte = ptr;
+    if (byte < slab->buffer || byte >= slab->buffer + slab->n_pages * ALLOC_SLAB_PAGE_SIZE) {
+        return ALLOC_SLAB_N_CLASSES;
+    }
+
+    const size_t page = (byte - slab->buffer) / ALLOC_SLAB_PAGE_SIZE;
+    if (slab->classes[page] == 0) {
+        return ALLOC_SLAB_N_CLASSES;
+    }
+
+    return slab->classes[page] - 1;
+}
+
+static void slab_free(const allocator_t *allocator, void *ptr) {
+    slab_t *const slab  = (slab_t *)allocator->arg;
+    const uint8_t class = slab_ptr_class(slab, ptr);
+
+    if (class == ALLOC_SLAB_N_CLASSES) {
+        allocator_dprintf("[ERROR] %s: pointer (%p) not owned by slab\n", __func__, ptr);
+        return;
+    }
+
+    // free blocks store the address of the next one
+    *(void **)ptr     = slab->free[class];
+    slab->free[class] = ptr;
+}
+
+static void *slab_malloc(const allocator_t *allocator, size_t size) {
+    slab_t *const slab  = (slab_t *)allocator->arg;
+    const uint8_t class = slab_class(size);
+
+    if (class == ALLOC_SLAB_N_CLASSES) {
+        allocator_dprintf("[ERROR] %s: size (%d) bigger than biggest class\n", __func__, (int)size);
+        return NULL;
+    }
+
+    // recycle a free'd block
+    void *ptr = slab->free[class];
+    if (ptr != NULL) {
+        slab->free[class] = *(void **)ptr;
+        return ptr;
+    }
+
+    // class' last page is full, assign a new one to it
+    if (slab->fresh[class].start == slab->fresh[class].end) {
+        if (slab->next_page >= slab->n_pages) {
+            allocator_dprintf("[ERROR] %s: out of pages\n", __func__);
+            return NULL;
+        }
+
+        const size_t page        = slab->next_page++;
+        slab->classes[page]      = class + 1;
+        slab->fresh[class].start = slab->buffer + page * ALLOC_SLAB_PAGE_SIZE;
+        slab->fresh[class].end   = slab->fresh[class].start + ALLOC_SLAB_PAGE_SIZE;
+    }
+
+    ptr = slab->fresh[class].start;
+    slab->fresh[class].start += slab_class_size(class);
+
+    return ptr;
+}
+
+static void *slab_realloc(const allocator_t *allocator, void *ptr, size_t size) {
+    slab_t *const slab  = (slab_t *)allocator->arg;
+    const uint8_t class = slab_ptr_class(slab, ptr);
+
+    if (class == ALLOC_SLAB_N_CLASSES) {
+        allocator_dprintf("[ERROR] %s: pointer (%p) not owned by slab\n", __func__, ptr);
+        return NULL;
+    }
+
+    // block has room for the new size
+    if (slab_class(size) <= class) {
+        return ptr;
+    }
+
+    void *new_ptr = slab_malloc(allocator, size);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+
+    memcpy(new_ptr, ptr, slab_class_size(class));
+    slab_free(allocator, ptr);
+
+    return new_ptr;
+}
+
+const allocator_t new_slab_allocator(slab_t *slab, const char *name) {
+    return (allocator_t){
+        .free    = slab_free,
+        .malloc  = slab_malloc,
+        .realloc = slab_realloc,
+        .name    = name,
+        .arg     = slab,
+    };
+}
+
+// every allocation in an arena is aligned to this
+#define ARENA_ALIGN (8)
+
+// space before each block of an arena, storing its size (an older block can't tell where it ends otherwise)
+// ARENA_ALIGN bytes, to keep the alignment of the block
+#define ARENA_HEADER (ARENA_ALIGN)
+
+static inline size_t *arena_header(void *ptr) {
+    return (size_t *)((uint8_t *)ptr - ARENA_HEADER);
+}
+
+static void arena_free(__unused const allocator_t *allocator, __unused void *ptr) {
+    // memory can only be given back by popping a scope
+}
+
+static void *arena_malloc(const allocator_t *allocator, size_t size) {
+    arena_t *const arena = (arena_t *)allocator->arg;
+
+    const size_t start = ((arena->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1)) + ARENA_HEADER;
+    if (start + size > arena->size) {
+        allocator_dprintf("[ERROR] %s: out of memory\n", __func__);
+        return NULL;
+    }
+
+    arena->used = start + size;
+    arena->last = arena->buffer + start;
+
+    *arena_header(arena->last) = size;
+    return arena->last;
 }
 
-static void free_shim(__unused const allocator_t *allocator, void *ptr) {
-    return __free(ptr);
+static void *arena_realloc(const allocator_t *allocator, void *ptr, size_t size) {
+    arena_t *const arena    = (arena_t *)allocator->arg;
+    const size_t   offset   = (uint8_t *)ptr - arena->buffer;
+    const size_t   old_size = *arena_header(ptr);
+
+    // latest allocation, just move the top
+    if (ptr == arena->last) {
+        if (offset + size > arena->size) {
+            allocator_dprintf("[ERROR] %s: out of memory\n", __func__);
+            return NULL;
+        }
+
+        arena->used        = offset + size;
+        *arena_header(ptr) = size;
+        return ptr;
+    }
+
+    // can't give space back in the middle of the arena
+    if (size <= old_size) {
+        return ptr;
+    }
+
+    void *new_ptr = arena_malloc(allocator, size);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+
+    memcpy(new_ptr, ptr, old_size);
+    return new_ptr;
 }
 
-static void *malloc_shim(__unused const allocator_t *allocator, size_t size) {
-    return __malloc(size);
+const allocator_t new_arena_allocator(arena_t *arena, const char *name) {
+    return (allocator_t){
+        .free    = arena_free,
+        .malloc  = arena_malloc,
+        .realloc = arena_realloc,
+        .name    = name,
+        .arg     = arena,
+    };
 }
 
-static void *realloc_shim(__unused const allocator_t *allocator, void *ptr, size_t size) {
-    return __realloc(ptr, size);
+arena_marker_t arena_push(const allocator_t *allocator) {
+    if (allocator == NULL || allocator->malloc != arena_malloc) {
+        allocator_dprintf("[ERROR] %s: not an arena allocator\n", __func__);
+        return 0;
+    }
+
+    const arena_t *const arena = (arena_t *)allocator->arg;
+    return arena->used;
 }
 
-const allocator_t _c_runtime_allocator = {
-    .calloc  = calloc_shim,
-    .free    = free_shim,
-    .malloc  = malloc_shim,
-    .realloc = realloc_shim,
-    .name    = "std",
-};
+void arena_pop(const allocator_t *allocator, arena_marker_t marker) {
+    if (allocator == NULL || allocator->malloc != arena_malloc) {
+        allocator_dprintf("[ERROR] %s: not an arena allocator\n", __func__);
+        return;
+    }
 
-const allocator_t *const c_runtime_allocator = &_c_runtime_allocator;
+    arena_t *const arena = (arena_t *)allocator->arg;
+    if (marker > arena->used) {
+        allocator_dprintf("[ERROR] %s: scope was already popped\n", __func__);
+        return;
+    }
+
+    release_stats_in(allocator, arena->buffer + marker, arena->buffer + arena->size);
+
+    arena->used = marker;
+    if (arena->last >= arena->buffer + marker) {
+        arena->last = NULL;
+    }
+}
 
 #if defined(PROTOCOL_CHIBIOS)
 static void *ch_core_malloc(__unused const allocator_t *allocator, size_t size) {
@@ -188,7 +935,7 @@ static void *ch_pool_malloc(const allocator_t *allocator, size_t size) {
     return chPoolAlloc(pool);
 }
 
-const allocator_t new_ch_pool_allocator(const memory_pool_t *pool, const char *name) {
+const allocator_t new_ch_pool_allocator(memory_pool_t *pool, const char *name) {
     return (allocator_t){
         .free   = ch_pool_free,
         .malloc = ch_pool_malloc,
@@ -196,6 +943,119 @@ const allocator_t new_ch_pool_allocator(const memory_pool_t *pool, const char *n
         .arg    = pool,
     };
 }
+
+// space before each block of a multi-pool allocator, storing the slot it came from
+// 8 bytes, to keep the alignment of the pools' objects
+#    define MULTIPOOL_HEADER (8)
+
+// marks blocks that were served by the fallback allocator
+#    define MULTIPOOL_FALLBACK (UINT8_MAX)
+
+STATIC_ASSERT(MULTIPOOL_HEADER >= PORT_NATURAL_ALIGN, "Header would misalign pool objects");
+
+// slot with the smallest objects that fit `size` bytes, `n_slots` if none does
+static size_t multipool_find_slot(const ch_multipool_t *state, size_t size) {
+    size_t best = state->n_slots;
+
+    for (size_t i = 0; i < state->n_slots; ++i) {
+        const size_t object_size = state->slots[i].pool->object_size;
+
+        if (object_size < size) {
+            continue;
+        }
+
+        if (best == state->n_slots || object_size < state->slots[best].pool->object_size) {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+static void ch_multipool_free(const allocator_t *allocator, void *ptr) {
+    ch_multipool_t *const state = (ch_multipool_t *)allocator->arg;
+    uint8_t *const        raw   = (uint8_t *)ptr - MULTIPOOL_HEADER;
+    const uint8_t         index = *raw;
+
+    if (index == MULTIPOOL_FALLBACK) {
+        state->fallback->free(state->fallback, raw);
+
+        chSysLock();
+        state->fallback_used--;
+        chSysUnlock();
+        return;
+    }
+
+    ch_multipool_slot_t *const slot = &state->slots[index];
+
+    chSysLock();
+    chPoolFreeI(slot->pool, raw);
+    slot->used--;
+    chSysUnlock();
+}
+
+static void *ch_multipool_malloc(const allocator_t *allocator, size_t size) {
+    ch_multipool_t *const state = (ch_multipool_t *)allocator->arg;
+    const size_t          index = multipool_find_slot(state, size + MULTIPOOL_HEADER);
+
+    uint8_t *raw = NULL;
+
+    if (index != state->n_slots) {
+        ch_multipool_slot_t *const slot = &state->slots[index];
+
+        chSysLock();
+        raw = chPoolAllocI(slot->pool);
+        if (raw != NULL) {
+            slot->used++;
+            slot->peak = MAX(slot->peak, slot->used);
+        } else {
+            slot->overflows++;
+        }
+        chSysUnlock();
+
+        if (raw != NULL) {
+            *raw = index;
+            return raw + MULTIPOOL_HEADER;
+        }
+    }
+
+    if (state->fallback == NULL) {
+        allocator_dprintf("[ERROR] %s: no pool for %d bytes, and no fallback\n", __func__, (int)size);
+        return NULL;
+    }
+
+    raw = state->fallback->malloc(state->fallback, size + MULTIPOOL_HEADER);
+    if (raw == NULL) {
+        return NULL;
+    }
+
+    chSysLock();
+    state->fallback_used++;
+    chSysUnlock();
+
+    *raw = MULTIPOOL_FALLBACK;
+    return raw + MULTIPOOL_HEADER;
+}
+
+const allocator_t new_ch_multipool_allocator(ch_multipool_t *state, const char *name) {
+    // slot's index is stored in a byte, highest value is reserved for the fallback
+    if (state->n_slots >= MULTIPOOL_FALLBACK) {
+        allocator_dprintf("[ERROR] %s: too many pools (%d)\n", __func__, (int)state->n_slots);
+
+        // no functions, every call on it fails (rather than routing frees to the wrong pool)
+        return (allocator_t){
+            .name = name,
+            .arg  = state,
+        };
+    }
+
+    return (allocator_t){
+        .free   = ch_multipool_free,
+        .malloc = ch_multipool_malloc,
+        .name   = name,
+        .arg    = state,
+    };
+}
 #    endif
 
 #    if CH_CFG_USE_HEAP == TRUE
@@ -207,18 +1067,163 @@ static void *ch_heap_malloc(const allocator_t *allocator, size_t size) {
     return chHeapAlloc((memory_heap_t *)allocator->arg, size);
 }
 
+// the helpers below rely on ChibiOS' heap internals (as of 21.11):
+//   - free blocks are kept on a list sorted by address, their size is measured in pages (header-sized units)
+//   - used blocks store the size requested, and span exactly the pages needed for it (chHeapFree relies on it too)
+
+// pages needed for `size` bytes
+#        define HEAP_PAGES(size) (((size) + CH_HEAP_ALIGNMENT - 1) / CH_HEAP_ALIGNMENT)
+
+static inline heap_header_t *heap_header(void *ptr) {
+    return (heap_header_t *)ptr - 1;
+}
+
+// header right after the last page of `header`
+static inline heap_header_t *heap_limit(heap_header_t *header, size_t pages) {
+    return header + 1 + pages;
+}
+
+static inline void heap_lock(memory_heap_t *heap) {
+#        if CH_CFG_USE_MUTEXES == TRUE
+    chMtxLock(&heap->mtx);
+#        else
+    chSemWait(&heap->sem);
+#        endif
+}
+
+static inline void heap_unlock(memory_heap_t *heap) {
+#        if CH_CFG_USE_MUTEXES == TRUE
+    chMtxUnlock(&heap->mtx);
+#        else
+    chSemSignal(&heap->sem);
+#        endif
+}
+
+// take over the free block right after `header` (if any), until it spans `pages`
+static bool heap_grow(heap_header_t *header, size_t old_pages, size_t pages) {
+    memory_heap_t *const heap  = header->used.heap;
+    heap_header_t *const limit = heap_limit(header, old_pages);
+
+    bool grown = false;
+
+    heap_lock(heap);
+
+    // find the adjacent free block, and the one pointing to it
+    heap_header_t *prev = &heap->header;
+    while (prev->free.next != NULL && prev->free.next < limit) {
+        prev = prev->free.next;
+    }
+
+    heap_header_t *const next = prev->free.next;
+    if (next != limit) {
+        goto exit;
+    }
+
+    // merging would span this many pages, as next's header is reclaimed too
+    const size_t available = old_pages + 1 + next->free.pages;
+    if (available < pages) {
+        goto exit;
+    }
+
+    if (available == pages) {
+        prev->free.next = next->free.next;
+    } else {
+        heap_header_t *const rest = heap_limit(header, pages);
+
+        rest->free.next  = next->free.next;
+        rest->free.pages = available - pages - 1;
+        prev->free.next  = rest;
+    }
+
+    grown = true;
+
+exit:
+    heap_unlock(heap);
+    return grown;
+}
+
+// give the pages after `pages` back to the heap
+static void heap_shrink(heap_header_t *header, size_t old_pages, size_t pages) {
+    heap_header_t *const rest = heap_limit(header, pages);
+
+    // turn the tail into a used block, and let ChibiOS free (and merge) it
+    rest->used.heap = header->used.heap;
+    rest->used.size = (old_pages - pages - 1) * CH_HEAP_ALIGNMENT;
+
+    chHeapFree(rest + 1);
+}
+
+static void *ch_heap_realloc(const allocator_t *allocator, void *ptr, size_t size) {
+    heap_header_t *const header    = heap_header(ptr);
+    const size_t         old_size  = header->used.size;
+    const size_t         old_pages = HEAP_PAGES(old_size);
+    const size_t         pages     = HEAP_PAGES(size);
+
+    if (pages == old_pages) {
+        header->used.size = size;
+        return ptr;
+    }
+
+    if (pages < old_pages) {
+        heap_shrink(header, old_pages, pages);
+        header->used.size = size;
+        return ptr;
+    }
+
+    if (heap_grow(header, old_pages, pages)) {
+        header->used.size = size;
+        return ptr;
+    }
+
+    // last resort: move the data elsewhere
+    void *new_ptr = chHeapAlloc((memory_heap_t *)allocator->arg, size);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+
+    memcpy(new_ptr, ptr, old_size);
+    chHeapFree(ptr);
+
+    return new_ptr;
+}
+
 const allocator_t new_ch_heap_allocator(memory_heap_t *heap, const char *name) {
     return (allocator_t){
-        .free   = ch_heap_free,
-        .malloc = ch_heap_malloc,
-        .name   = name,
-        .arg    = heap,
+        .free    = ch_heap_free,
+        .malloc  = ch_heap_malloc,
+        .realloc = ch_heap_realloc,
+        .name    = name,
+        .arg     = heap,
     };
 }
+
+void get_heap_fragmentation(memory_heap_t *heap, heap_fragmentation_t *frag) {
+    *frag = (heap_fragmentation_t){0};
+
+    frag->free_blocks = chHeapStatus(heap, &frag->free, &frag->largest);
+    if (frag->free != 0) {
+        frag->index = 100 - (100 * frag->largest) / frag->free;
+    }
+
+    for (size_t core = 0; core < ALLOC_N_CORES; ++core) {
+        const alloc_state_t *const alloc = &alloc_states[core];
+
+        for (size_t i = 0; i < alloc->stats.count; ++i) {
+            const alloc_stats_t *const stat = &alloc->stats.ptr[i];
+
+            if (stat->lifetime.end != 0 || stat->allocator->malloc != ch_heap_malloc || stat->allocator->arg != heap) {
+                continue;
+            }
+
+            frag->used += stat->size;
+            frag->used_blocks++;
+        }
+    }
+}
 #    endif
 #endif
 
-void *calloc_with(const allocator_t *allocator, size_t nmemb, size_t size) {
+void *_calloc_with(const allocator_t *allocator, size_t nmemb, size_t size, const void *caller) {
     if (allocator == NULL) {
         allocator_dprintf("[ERROR]: NULL allocator in %s\n", __func__);
         return NULL;
@@ -237,10 +1242,10 @@ void *calloc_with(const allocator_t *allocator, size_t nmemb, size_t size) {
         if (ptr == NULL) {
             allocator_dprintf("[ERROR]: %s.calloc failed\n", allocator->name);
         } else {
-            push_new_stat(allocator, ptr, total_size);
+            push_new_stat(allocator, ptr, total_size, caller);
         }
     } else {
-        ptr = malloc_with(allocator, total_size);
+        ptr = _malloc_with(allocator, total_size, caller);
 
         if (ptr != NULL) {
             memset(ptr, 0, total_size);
@@ -263,22 +1268,32 @@ void free_with(const allocator_t *allocator, void *ptr) {
         return;
     }
 
+    remote_free_drain();
+
     alloc_stats_t *stat = get_stats(ptr);
     if (stat != NULL && stat->allocator != allocator) {
         allocator_dprintf("[ERROR]: Can't `free` with a different allocator\n");
         return;
     }
 
+    // stats are kept by the core that allocated the memory (per-core allocators forward the block itself to it)
+    if (stat == NULL && allocator->free != per_core_free) {
+#if ALLOC_N_CORES > 1
+        // before freeing, so that the record is gone by the time the address can be given out again
+        remote_free(ptr);
+#else
+        allocator_dprintf("[WARN]: Could not find pointer (%p) in tracked allocations\n", ptr);
+#endif
+    }
+
     allocator->free(allocator, ptr);
 
     if (stat != NULL) {
-        stat->lifetime.end = timer_read32();
-    } else {
-        allocator_dprintf("[WARN]: Could not find pointer (%p) in tracked allocations\n", ptr);
+        pop_stat(stat);
     }
 }
 
-void *malloc_with(const allocator_t *allocator, size_t size) {
+void *_malloc_with(const allocator_t *allocator, size_t size, const void *caller) {
     if (allocator == NULL) {
         allocator_dprintf("[ERROR]: NULL allocator in %s\n", __func__);
         return NULL;
@@ -295,13 +1310,13 @@ void *malloc_with(const allocator_t *allocator, size_t size) {
     if (ptr == NULL) {
         allocator_dprintf("[ERROR]: Calling %s.malloc failed\n", allocator->name);
     } else {
-        push_new_stat(allocator, ptr, size);
+        push_new_stat(allocator, ptr, size, caller);
     }
 
     return ptr;
 }
 
-void *realloc_with(const allocator_t *allocator, void *ptr, size_t size) {
+void *_realloc_with(const allocator_t *allocator, void *ptr, size_t size, const void *caller) {
     if (allocator == NULL) {
         allocator_dprintf("[ERROR]: NULL allocator in %s\n", __func__);
         return NULL;
@@ -311,7 +1326,7 @@ void *realloc_with(const allocator_t *allocator, void *ptr, size_t size) {
 
     // no pointer, realloc is equivalent to malloc
     if (ptr == NULL) {
-        return malloc_with(allocator, size);
+        return _malloc_with(allocator, size, caller);
     }
 
     // pointer and new size is 0, realloc is equivalent to free
@@ -331,8 +1346,8 @@ void *realloc_with(const allocator_t *allocator, void *ptr, size_t size) {
         return NULL;
     }
 
-    // big enough, just return the current address back
-    if (stat->size >= size) {
+    // big enough, and no way of giving the excess back: just return the current address
+    if (stat->size >= size && allocator->realloc == NULL) {
         return ptr;
     }
 
@@ -341,13 +1356,20 @@ void *realloc_with(const allocator_t *allocator, void *ptr, size_t size) {
     // actual realloc if available, manually implement with malloc + memcpy otherwise
     if (allocator->realloc != NULL) {
         new_ptr = allocator->realloc(allocator, ptr, size);
-        allocator_dprintf("[ERROR]: %s.realloc failed\n", allocator->name);
+
+        if (new_ptr == NULL) {
+            allocator_dprintf("[ERROR]: %s.realloc failed\n", allocator->name);
+        } else {
+            move_stat(stat, new_ptr, size);
+        }
     } else {
-        new_ptr = malloc_with(allocator, size);
+        // new pointer gets tracked by malloc_with
+        new_ptr = _malloc_with(allocator, size, caller);
 
-        // move current contents
+        // move current contents, and release the old block
         if (new_ptr != NULL) {
             memcpy(new_ptr, ptr, stat->size);
+            free_with(allocator, ptr);
         }
     }
 
@@ -358,13 +1380,67 @@ void *realloc_with(const allocator_t *allocator, void *ptr, size_t size) {
         return NULL;
     }
 
-    // update stats
-    stat->size = size;
-    stat->ptr  = new_ptr;
-
     return new_ptr;
 }
 
+// `__builtin_return_address` must be evaluated here, not deeper in the call stack
+// nor on a caller, if these got inlined (eg: LTO), hence `noinline`
+__attribute__((noinline)) void *calloc_with(const allocator_t *allocator, size_t nmemb, size_t size) {
+    return _calloc_with(allocator, nmemb, size, __builtin_return_address(0));
+}
+
+__attribute__((noinline)) void *malloc_with(const allocator_t *allocator, size_t size) {
+    return _malloc_with(allocator, size, __builtin_return_address(0));
+}
+
+__attribute__((noinline)) void *realloc_with(const allocator_t *allocator, void *ptr, size_t size) {
+    return _realloc_with(allocator, ptr, size, __builtin_return_address(0));
+}
+
+#if defined(COMMUNITY_MODULE_CRASH_ENABLE)
+#    include <backtrace.h>
+#endif
+
+void print_alloc_sites(size_t n) {
+    const alloc_state_t *const alloc = local_alloc();
+
+    // partial selection sort, by live bytes
+    uint8_t order[ALLOC_SITES_SIZE];
+    for (uint8_t i = 0; i < alloc->sites.count; ++i) {
+        order[i] = i;
+    }
+
+    n = MIN(n, alloc->sites.count);
+    for (size_t i = 0; i < n; ++i) {
+        size_t top = i;
+        for (size_t j = i + 1; j < alloc->sites.count; ++j) {
+            if (alloc->sites.ptr[order[j]].live > alloc->sites.ptr[order[top]].live) {
+                top = j;
+            }
+        }
+
+        const uint8_t tmp = order[i];
+        order[i]          = order[top];
+        order[top]        = tmp;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        const alloc_site_t site = alloc->sites.ptr[order[i]];
+
+        // lowest bit of return addresses flags Thumb mode, drop it
+#if defined(COMMUNITY_MODULE_CRASH_ENABLE)
+        printf("%s ", backtrace_function_name((uintptr_t)site.caller & ~1));
+#endif
+        printf("(%p): live=%d peak=%d count=%d", site.caller, (int)site.live, (int)site.peak, (int)site.count);
+
+        if (site.freed != 0) {
+            printf(" lifetime=%dms", (int)(site.lifetime / site.freed));
+        }
+
+        printf("\n");
+    }
+}
+
 #if defined(COMMUNITY_MODULE_UI_ENABLE)
 #    include "elpekenin/ui/utils.h"
 
@@ -421,4 +1497,159 @@ err:
 exit:
     return args->interval;
 }
+
+static inline bool heap_map_get(const uint8_t *bits, size_t px) {
+    return (bits[px / 8] & (1 << (px % 8))) != 0;
+}
+
+static inline void heap_map_set(uint8_t *bits, size_t px) {
+    bits[px / 8] |= 1 << (px % 8);
+}
+
+bool heap_map_init(ui_node_t *self) {
+    heap_map_args_t *const args = self->args;
+    args->drawn                 = false;
+    return args->size != 0;
+}
+
+ui_time_t heap_map_render(const ui_node_t *self, painter_device_t display) {
+    heap_map_args_t *const args = self->args;
+
+    const size_t width = MIN(self->size.x, ALLOC_HEAP_MAP_WIDTH);
+    if (width == 0) {
+        goto exit;
+    }
+
+    // bytes represented by each pixel
+    const size_t    bytes = (args->size + width - 1) / width;
+    const uintptr_t start = (uintptr_t)args->start;
+    const uintptr_t end   = start + args->size;
+
+    uint8_t now[sizeof(args->last)] = {0};
+
+    for (size_t core = 0; core < ALLOC_N_CORES; ++core) {
+        const alloc_state_t *const alloc = &alloc_states[core];
+
+        for (size_t i = 0; i < alloc->stats.count; ++i) {
+            const alloc_stats_t *const stat = &alloc->stats.ptr[i];
+
+            if (stat->lifetime.end != 0) {
+                continue;
+            }
+
+            const uintptr_t first = MAX((uintptr_t)stat->ptr, start);
+            const uintptr_t last  = MIN((uintptr_t)stat->ptr + stat->size, end);
+            if (first >= last) {
+                continue;
+            }
+
+            for (size_t px = (first - start) / bytes; px <= (last - 1 - start) / bytes; ++px) {
+                heap_map_set(now, px);
+            }
+        }
+    }
+
+    // draw runs of pixels that changed to the same state
+    const ui_coord_t bottom = self->start.y + self->size.y - 1;
+
+    size_t px = 0;
+    while (px < width) {
+        const bool used = heap_map_get(now, px);
+
+        if (args->drawn && used == heap_map_get(args->last, px)) {
+            ++px;
+            continue;
+        }
+
+        size_t run = px + 1;
+        while (run < width && heap_map_get(now, run) == used && (!args->drawn || heap_map_get(args->last, run) != used)) {
+            ++run;
+        }
+
+        const ui_coord_t left  = self->start.x + px;
+        const ui_coord_t right = self->start.x + run - 1;
+        if (used) {
+            qp_rect(display, left, self->start.y, right, bottom, HSV_RED, true);
+        } else {
+            qp_rect(display, left, self->start.y, right, bottom, HSV_GREEN, true);
+        }
+
+        px = run;
+    }
+
+    memcpy(args->last, now, sizeof(now));
+    args->drawn = true;
+
+exit:
+    return args->interval;
+}
+#endif
+
+#if defined(ALLOC_TRACE_ENABLE)
+// print up to `budget` events of a core, returns how many were printed
+static size_t drain_trace(uint8_t core, size_t budget) {
+    alloc_state_t *const alloc = &alloc_states[core];
+
+    // first, names of the allocators that events may refer to
+    const size_t n_allocators = alloc->ators.count;
+    for (; alloc->trace.announced < n_allocators; ++alloc->trace.announced) {
+        printf("[ALLOC_TRACE] A %d %d %s\n", core, (int)alloc->trace.announced, alloc->ators.ptr[alloc->trace.announced]->name);
+    }
+
+    // counter is owned by the other core, don't reset it (M0+ has no atomic exchange)
+    const uint32_t dropped = __atomic_load_n(&alloc->trace.dropped, __ATOMIC_RELAXED);
+    if (dropped != alloc->trace.reported) {
+        printf("[ALLOC_TRACE] D %d %d\n", core, (int)(dropped - alloc->trace.reported));
+        alloc->trace.reported = dropped;
+    }
+
+    const uint32_t head = __atomic_load_n(&alloc->trace.head, __ATOMIC_ACQUIRE);
+    uint32_t       tail = alloc->trace.tail;
+
+    size_t printed = 0;
+    for (; tail != head && printed < budget; ++tail, ++printed) {
+        const uint8_t *bytes = (const uint8_t *)&alloc->trace.events[tail % ALLOC_TRACE_SIZE];
+
+        printf("[ALLOC_TRACE] E %d ", core);
+        for (size_t i = 0; i < sizeof(alloc_trace_event_t); ++i) {
+            printf("%02x", bytes[i]);
+        }
+        printf("\n");
+    }
+
+    __atomic_store_n(&alloc->trace.tail, tail, __ATOMIC_RELEASE);
+
+    return printed;
+}
 #endif
+
+//
+// QMK hooks
+//
+
+ASSERT_COMMUNITY_MODULES_MIN_API_VERSION(1, 0, 0);
+
+#if defined(ALLOC_TRACE_ENABLE)
+void housekeeping_task_allocator(void) {
+    size_t budget = ALLOC_TRACE_DRAIN_COUNT;
+
+    for (uint8_t core = 0; core < ALLOC_N_CORES; ++core) {
+        budget -= drain_trace(core, budget);
+    }
+
+    housekeeping_task_allocator_kb();
+}
+#endif
+
+bool process_record_allocator(uint16_t keycode, keyrecord_t *record) {
+    if (!process_record_allocator_kb(keycode, record)) {
+        return false;
+    }
+
+    if (keycode == COMMUNITY_MODULE_ALLOC_SITES && record->event.pressed) {
+        print_alloc_sites(ALLOC_SITES_PRINT_COUNT);
+        return false;
+    }
+
+    return true;
+}
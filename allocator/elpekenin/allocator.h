@@ -11,7 +11,9 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "compiler_support.h"
 #include "util.h"
@@ -26,6 +28,97 @@
 #    define ALLOC_ALLOCATIONS_SIZE (100)
 #endif
 
+// How many cores may use the allocators, each of them keeps its own stats.
+#ifndef ALLOC_N_CORES
+#    if defined(COMMUNITY_MODULE_DUAL_RP_ENABLE)
+#        define ALLOC_N_CORES (2)
+#    else
+#        define ALLOC_N_CORES (1)
+#    endif
+#endif
+
+// How many blocks can be queued to be free'd by the core that allocated them.
+// Must be a power of 2.
+#ifndef ALLOC_PER_CORE_QUEUE_SIZE
+#    define ALLOC_PER_CORE_QUEUE_SIZE (32)
+#endif
+
+STATIC_ASSERT((ALLOC_PER_CORE_QUEUE_SIZE & (ALLOC_PER_CORE_QUEUE_SIZE - 1)) == 0, "ALLOC_PER_CORE_QUEUE_SIZE must be a power of 2");
+
+// How many different call sites (places calling ``malloc_with``/``calloc_with``) will be tracked.
+#ifndef ALLOC_SITES_SIZE
+#    define ALLOC_SITES_SIZE (32)
+#endif
+
+// How many call sites will be printed by the ``AL_SITE`` keycode.
+#ifndef ALLOC_SITES_PRINT_COUNT
+#    define ALLOC_SITES_PRINT_COUNT (10)
+#endif
+
+STATIC_ASSERT(ALLOC_SITES_SIZE < UINT8_MAX, "ALLOC_SITES_SIZE is too big");
+
+// How many allocation events can be buffered, when tracing is enabled (``#define ALLOC_TRACE_ENABLE``).
+#ifndef ALLOC_TRACE_SIZE
+#    define ALLOC_TRACE_SIZE (64)
+#endif
+
+// How many allocation events will be printed (at most) on each housekeeping.
+#ifndef ALLOC_TRACE_DRAIN_COUNT
+#    define ALLOC_TRACE_DRAIN_COUNT (8)
+#endif
+
+// How big the hash table to find allocations' metadata (by pointer) will be.
+// Must be a power of 2, and at least twice as big as ``ALLOC_ALLOCATIONS_SIZE``.
+#ifndef ALLOC_INDEX_SIZE
+#    define ALLOC_INDEX_SIZE (256)
+#endif
+
+STATIC_ASSERT((ALLOC_INDEX_SIZE & (ALLOC_INDEX_SIZE - 1)) == 0, "ALLOC_INDEX_SIZE must be a power of 2");
+STATIC_ASSERT(ALLOC_INDEX_SIZE >= 2 * ALLOC_ALLOCATIONS_SIZE, "ALLOC_INDEX_SIZE is too small");
+STATIC_ASSERT(ALLOC_ALLOCATIONS_SIZE < UINT16_MAX, "ALLOC_ALLOCATIONS_SIZE is too big");
+
+// Smallest size class of slab allocators, as a power of 2 (ie: 8 bytes).
+#ifndef ALLOC_SLAB_MIN_SHIFT
+#    define ALLOC_SLAB_MIN_SHIFT (3)
+#endif
+
+// Biggest size class of slab allocators, as a power of 2 (ie: 256 bytes).
+#ifndef ALLOC_SLAB_MAX_SHIFT
+#    define ALLOC_SLAB_MAX_SHIFT (8)
+#endif
+
+// Granularity in which a slab allocator's buffer is handed to the size classes.
+#ifndef ALLOC_SLAB_PAGE_SIZE
+#    define ALLOC_SLAB_PAGE_SIZE (1024)
+#endif
+
+#define ALLOC_SLAB_N_CLASSES (ALLOC_SLAB_MAX_SHIFT - ALLOC_SLAB_MIN_SHIFT + 1)
+
+// Biggest block a TLSF allocator can manage, as a power of 2 (ie: 128KB).
+#ifndef ALLOC_TLSF_FL_MAX
+#    define ALLOC_TLSF_FL_MAX (17)
+#endif
+
+// How many second-level lists each first-level (power of 2) range is split in, as a power of 2.
+#ifndef ALLOC_TLSF_SL_LOG2
+#    define ALLOC_TLSF_SL_LOG2 (4)
+#endif
+
+#define ALLOC_TLSF_ALIGN_LOG2 (3)
+#define ALLOC_TLSF_FL_SHIFT (ALLOC_TLSF_SL_LOG2 + ALLOC_TLSF_ALIGN_LOG2)
+#define ALLOC_TLSF_FL_COUNT (ALLOC_TLSF_FL_MAX - ALLOC_TLSF_FL_SHIFT + 1)
+#define ALLOC_TLSF_SL_COUNT (1 << ALLOC_TLSF_SL_LOG2)
+
+// smallest buffer for a TLSF allocator: headers of a block and of the end sentinel, plus the smallest payload
+#define ALLOC_TLSF_MIN_SIZE (4 * sizeof(void *) + 2 * sizeof(size_t))
+
+STATIC_ASSERT(ALLOC_TLSF_FL_MAX < 32, "ALLOC_TLSF_FL_MAX is too big");
+STATIC_ASSERT(ALLOC_TLSF_SL_LOG2 <= 5, "ALLOC_TLSF_SL_LOG2 is too big");
+
+STATIC_ASSERT(ALLOC_SLAB_MIN_SHIFT >= 2, "Slab blocks must be able to hold a pointer");
+STATIC_ASSERT(ALLOC_SLAB_PAGE_SIZE >= (1 << ALLOC_SLAB_MAX_SHIFT), "Slab pages must fit the biggest size class");
+STATIC_ASSERT(ALLOC_SLAB_PAGE_SIZE % (1 << ALLOC_SLAB_MAX_SHIFT) == 0, "Slab pages must be a multiple of the biggest size class");
+
 typedef struct allocator_t allocator_t;
 
 /**
@@ -66,8 +159,105 @@ typedef struct PACKED {
      * Allocation's duration.
      */
     lifetime_t lifetime;
+
+    /**
+     * Return address of the function that requested this memory.
+     */
+    const void *caller;
 } alloc_stats_t;
 
+/**
+ * Information about the allocations requested from a call site.
+ */
+typedef struct {
+    /**
+     * Return address of the function requesting memory.
+     */
+    const void *caller;
+
+    /**
+     * Bytes currently allocated.
+     */
+    size_t live;
+
+    /**
+     * Highest value that ``live`` has reached.
+     */
+    size_t peak;
+
+    /**
+     * Number of allocations.
+     */
+    size_t count;
+
+    /**
+     * Number of allocations already free'd.
+     */
+    size_t freed;
+
+    /**
+     * Sum of the duration of the allocations already free'd, in milliseconds.
+     */
+    uint32_t lifetime;
+} alloc_site_t;
+
+#if defined(ALLOC_TRACE_ENABLE) || defined(__SPHINX__)
+/**
+ * Kind of allocation event.
+ */
+typedef enum {
+    /** */
+    ALLOC_TRACE_MALLOC,
+    /** */
+    ALLOC_TRACE_FREE,
+    /** */
+    ALLOC_TRACE_REALLOC,
+} alloc_trace_op_t;
+
+/**
+ * An allocation event, as recorded when tracing is enabled.
+ *
+ * Events are printed (hex-encoded) over console from ``housekeeping_task``, one per line:
+ *
+ * * ``[ALLOC_TRACE] A <core> <id> <name>``: Name of the allocator with the given id.
+ * * ``[ALLOC_TRACE] E <core> <hex>``: Bytes of an event (this struct, little endian).
+ * * ``[ALLOC_TRACE] D <core> <count>``: Number of events lost because buffer was full.
+ *
+ * Capturing them allows replaying real workloads against other allocators on a computer.
+ */
+typedef struct PACKED {
+    /**
+     * When the event happened, in milliseconds.
+     */
+    uint32_t timestamp;
+
+    /**
+     * Address being free'd or reallocated, ``0`` for ``malloc``.
+     */
+    uint32_t old_ptr;
+
+    /**
+     * Address returned by allocator, ``0`` for ``free``.
+     */
+    uint32_t ptr;
+
+    /**
+     * Size of the (new) memory region, or the one being free'd.
+     */
+    uint32_t size;
+
+    /**
+     * :c:type:`alloc_trace_op_t` of this event.
+     */
+    uint8_t op;
+
+    /**
+     * Identifier of the allocator used (per-core).
+     */
+    uint8_t allocator;
+} alloc_trace_event_t;
+#endif
+
 /**
  * Signature of a ``malloc``-like function.
  */
@@ -150,15 +340,41 @@ void *calloc_with(const allocator_t *allocator, size_t nmemb, size_t size);
  */
 void *realloc_with(const allocator_t *allocator, void *ptr, size_t size);
 
+// Not intended to be used by users -> no docstring
+void *_malloc_with(const allocator_t *allocator, size_t total_size, const void *caller);
+void *_calloc_with(const allocator_t *allocator, size_t nmemb, size_t size, const void *caller);
+void *_realloc_with(const allocator_t *allocator, void *ptr, size_t size, const void *caller);
+
 /**
  * Total heap used between all allocators.
  */
 size_t get_used_heap(void);
 
+/**
+ * Heap used by a specific allocator.
+ */
+size_t get_used_heap_by(const allocator_t *allocator);
+
+/**
+ * Highest value that :c:func:`get_used_heap` has reached.
+ */
+size_t get_peak_heap(void);
+
+/**
+ * Highest value that :c:func:`get_used_heap_by` has reached for a specific allocator.
+ *
+ * .. hint::
+ *   Combine it with :c:func:`get_known_allocators` to find out how big each of your buffers needs to be.
+ */
+size_t get_peak_heap_by(const allocator_t *allocator);
+
 /**
  * Get a pointer to every allocator implementation.
  *
  * :c:var:`n` will be set to the number of allocators.
+ *
+ * .. note::
+ *   With several cores, only the allocators used by the calling core are returned.
  */
 const allocator_t *const *get_known_allocators(size_t *n);
 
@@ -166,11 +382,323 @@ const allocator_t *const *get_known_allocators(size_t *n);
  * Get a pointer to every tracked allocation implementation.
  *
  * :c:var:`n` will be set to the number of allocation.
+ *
+ * .. note::
+ *   With several cores, only the allocations made by the calling core are returned. Frees done by another core are
+ *   queued back to it, and applied upon its next call to the allocation functions (or this one).
+ *
+ * .. note::
+ *   Slots of free'd allocations (``lifetime.end != 0``) get recycled once the array is full.
  */
 const alloc_stats_t *get_allocations(size_t *n);
 
+/**
+ * Get a pointer to every tracked call site.
+ *
+ * :c:var:`n` will be set to the number of call sites.
+ *
+ * .. note::
+ *   With several cores, only the call sites seen by the calling core are returned.
+ */
+const alloc_site_t *get_alloc_sites(size_t *n);
+
+/**
+ * Print the ``n`` call sites with the most live bytes.
+ *
+ * If the ``crash`` module is enabled, functions' names are printed along their addresses.
+ *
+ * .. hint::
+ *   You can also use the ``AL_SITE`` keycode, which prints :c:macro:`ALLOC_SITES_PRINT_COUNT` of them.
+ */
+void print_alloc_sites(size_t n);
+
 extern const allocator_t *const c_runtime_allocator;
 
+/**
+ * State of a slab allocator.
+ *
+ * Its buffer is split in pages of :c:macro:`ALLOC_SLAB_PAGE_SIZE` bytes, which get assigned to a (power of 2) size class on demand.
+ * Each class keeps a list of its free blocks, making both allocating and freeing constant-time.
+ *
+ * .. note::
+ *   Once a page is assigned to a class, it stays there. Size your buffer for the peak usage of each class.
+ *
+ * Use :c:macro:`SLAB_DECL` instead of creating it manually.
+ */
+typedef struct {
+    /**
+     * Memory to be handed out.
+     */
+    uint8_t *const buffer;
+
+    /**
+     * Size class (plus one) of each page, ``0`` if not yet assigned.
+     */
+    uint8_t *const classes;
+
+    /**
+     * Number of pages in the buffer.
+     */
+    const size_t n_pages;
+
+    /**
+     * Pages are assigned sequentially, index of the first unused one.
+     */
+    size_t next_page;
+
+    /**
+     * Head of the list of free blocks, for each class.
+     */
+    void *free[ALLOC_SLAB_N_CLASSES];
+
+    /**
+     * Unused section of the last page assigned to each class.
+     */
+    struct {
+        uint8_t *start;
+        uint8_t *end;
+    } fresh[ALLOC_SLAB_N_CLASSES];
+} slab_t;
+
+/**
+ * Declare a :c:type:`slab_t` named ``name``, with a buffer of ``pages``.
+ */
+#define SLAB_DECL(name, pages)                                                              \
+    static uint8_t __attribute__((aligned(8))) name##_buffer[(pages)*ALLOC_SLAB_PAGE_SIZE]; \
+    static uint8_t name##_classes[(pages)];                                                 \
+    static slab_t  name = {                                                                 \
+        .buffer  = name##_buffer,                                                           \
+        .classes = name##_classes,                                                          \
+        .n_pages = (pages),                                                                 \
+    }
+
+/**
+ * Create a new slab allocator.
+ */
+const allocator_t new_slab_allocator(slab_t *slab, const char *name);
+
+/**
+ * State of a Two-Level Segregated Fit allocator.
+ *
+ * Free blocks are kept in lists segregated by size: a first level for each power of 2, split linearly into :c:macro:`ALLOC_TLSF_SL_COUNT` second-level ranges.
+ * A bitmap per level tracks which lists are not empty, so finding a suitable block is a couple of bit scans instead of a search.
+ *
+ * ``malloc``, ``free`` and ``realloc`` (when resizing in place) have no loops at all, their worst-case latency is bounded by a constant regardless of the heap's state.
+ * This makes them suitable for time-sensitive code (eg: housekeeping or indicators callbacks).
+ *
+ * .. note::
+ *   Each allocation has an overhead of two pointers, and the returned addresses are 8-byte aligned.
+ *
+ * Use :c:macro:`TLSF_DECL` instead of creating it manually.
+ */
+typedef struct {
+    /**
+     * Memory to be handed out.
+     */
+    uint8_t *const buffer;
+
+    /**
+     * Size of the buffer.
+     */
+    const size_t size;
+
+    /**
+     * Whether the buffer has been set up as a single free block.
+     */
+    bool initialized;
+
+    /**
+     * Bitmap of first-level ranges with free blocks.
+     */
+    uint32_t fl_bitmap;
+
+    /**
+     * Bitmap of second-level lists with free blocks, for each first-level range.
+     */
+    uint32_t sl_bitmap[ALLOC_TLSF_FL_COUNT];
+
+    /**
+     * Head of each list of free blocks.
+     */
+    void *blocks[ALLOC_TLSF_FL_COUNT][ALLOC_TLSF_SL_COUNT];
+} tlsf_t;
+
+/**
+ * Declare a :c:type:`tlsf_t` named ``name``, with a buffer of ``bytes``.
+ */
+#define TLSF_DECL(name, bytes)                                                                    \
+    STATIC_ASSERT((bytes) <= (1 << ALLOC_TLSF_FL_MAX), "Buffer is too big for ALLOC_TLSF_FL_MAX"); \
+    STATIC_ASSERT((bytes) >= ALLOC_TLSF_MIN_SIZE, "Buffer is too small for a single block");       \
+    static uint8_t __attribute__((aligned(8))) name##_buffer[(bytes)];                            \
+    static tlsf_t  name = {                                                                       \
+        .buffer = name##_buffer,                                                                  \
+        .size   = (bytes),                                                                        \
+    }
+
+/**
+ * Create a new TLSF allocator.
+ */
+const allocator_t new_tlsf_allocator(tlsf_t *tlsf, const char *name);
+
+/**
+ * State of an arena (bump) allocator.
+ *
+ * Allocating is just moving a pointer forward, and memory is given back in bulk by going back to a previous position.
+ * This makes it a good fit for temporary buffers whose lifetime is a well-defined scope (eg: rendering a frame).
+ *
+ * .. code-block:: c
+ *
+ *     ARENA_DECL(frame_arena, 1024);
+ *
+ *     // must not live on the stack, see warning below
+ *     static allocator_t frame;
+ *
+ *     void keyboard_post_init_user(void) {
+ *         frame = new_arena_allocator(&frame_arena, "frame");
+ *     }
+ *
+ *     void render(void) {
+ *         const arena_marker_t marker = arena_push(&frame);
+ *
+ *         char *buf = malloc_with(&frame, 100);
+ *         // ...
+ *
+ *         // everything allocated since `arena_push` is released at once
+ *         arena_pop(&frame, marker);
+ *     }
+ *
+ * .. note::
+ *   Calling ``free_with`` is allowed, but memory is only reclaimed when popping the scope.
+ *
+ * .. note::
+ *   Each allocation takes 8 extra bytes, storing its size so that older allocations can be ``realloc``'ed safely.
+ *
+ * .. warning::
+ *   Allocators are tracked by their address once used. Thus, the :c:type:`allocator_t` must outlive the program
+ *   (global or ``static``), a local one would leave a dangling pointer behind.
+ *
+ * Use :c:macro:`ARENA_DECL` instead of creating it manually.
+ */
+typedef struct {
+    /**
+     * Memory to be handed out.
+     */
+    uint8_t *const buffer;
+
+    /**
+     * Size of the buffer.
+     */
+    const size_t size;
+
+    /**
+     * Bytes in use (from the start of the buffer).
+     */
+    size_t used;
+
+    /**
+     * Latest allocation, which can be grown in place.
+     */
+    uint8_t *last;
+} arena_t;
+
+/**
+ * Position of an arena, to go back to it later.
+ */
+typedef size_t arena_marker_t;
+
+/**
+ * Declare a :c:type:`arena_t` named ``name``, with a buffer of ``bytes``.
+ */
+#define ARENA_DECL(name, bytes)                                        \
+    static uint8_t __attribute__((aligned(8))) name##_buffer[(bytes)]; \
+    static arena_t name = {                                            \
+        .buffer = name##_buffer,                                       \
+        .size   = (bytes),                                             \
+    }
+
+/**
+ * Create a new arena allocator.
+ */
+const allocator_t new_arena_allocator(arena_t *arena, const char *name);
+
+/**
+ * Open a scope in an arena allocator.
+ *
+ * Return: Marker to be given to :c:func:`arena_pop` when the scope ends.
+ */
+arena_marker_t arena_push(const allocator_t *allocator);
+
+/**
+ * Release everything allocated in an arena allocator since the scope was opened.
+ */
+void arena_pop(const allocator_t *allocator, arena_marker_t marker);
+
+/**
+ * Blocks given back to a core by another one.
+ *
+ * Single-producer single-consumer ring, which only needs atomic loads/stores (no compare-and-swap, unavailable on Cortex-M0+).
+ */
+typedef struct {
+    /**
+     * Blocks to be free'd.
+     */
+    void *ptr[ALLOC_PER_CORE_QUEUE_SIZE];
+
+    /**
+     * Write position, only modified by the core freeing the blocks.
+     */
+    uint32_t head;
+
+    /**
+     * Read position, only modified by the core owning the blocks.
+     */
+    uint32_t tail;
+
+    /**
+     * Number of blocks leaked because the queue was full, only modified by the core freeing the blocks.
+     */
+    uint32_t dropped;
+} per_core_queue_t;
+
+/**
+ * State of a per-core allocator.
+ *
+ * Each core allocates from its own backend, so that they never touch the same memory (nor stats) concurrently.
+ * When a core frees a block that another one allocated, the block is queued back to its owner, which frees it the next time it uses the allocator.
+ *
+ * .. code-block:: c
+ *
+ *     // eg: two TLSF allocators, each one with its own buffer
+ *     static per_core_t shared_state = {
+ *         .backends = {&core0_allocator, &core1_allocator},
+ *     };
+ *
+ *     const allocator_t shared = new_per_core_allocator(&shared_state, "shared");
+ *
+ * .. note::
+ *   Each block has an overhead of 8 bytes, to store which core allocated it.
+ *
+ * .. warning::
+ *   Blocks must not be free'd from an ISR. Neither the backends nor the allocation stats are protected against
+ *   being used from an interrupt.
+ */
+typedef struct {
+    /**
+     * Allocator used by each core. Must not be shared between cores.
+     */
+    const allocator_t *const backends[ALLOC_N_CORES];
+
+    /**
+     * Blocks to be free'd, as ``queues[owner][freeing_core]``.
+     */
+    per_core_queue_t queues[ALLOC_N_CORES][ALLOC_N_CORES];
+} per_core_t;
+
+/**
+ * Create a new per-core allocator.
+ */
+const allocator_t new_per_core_allocator(per_core_t *state, const char *name);
+
 #if defined(PROTOCOL_CHIBIOS) || defined(__SPHINX__)
 #    include <ch.h>
 #    include <chmemcore.h>
@@ -188,6 +716,89 @@ extern const allocator_t *const ch_core_allocator;
  * Create a new ChibiOS' pool allocator.
  */
 const allocator_t new_ch_pool_allocator(memory_pool_t *pool, const char *name);
+
+/**
+ * A pool used by a multi-pool allocator, along with its occupancy counters.
+ */
+typedef struct {
+    /**
+     * ChibiOS' pool.
+     */
+    memory_pool_t *const pool;
+
+    /**
+     * Objects currently handed out from this pool.
+     */
+    size_t used;
+
+    /**
+     * Maximum value that ``used`` has reached.
+     */
+    size_t peak;
+
+    /**
+     * Requests that fitted in this pool, but went to the fallback because it was empty.
+     */
+    size_t overflows;
+} ch_multipool_slot_t;
+
+/**
+ * State of a multi-pool allocator.
+ *
+ * Each request is served by the pool with the smallest object size that fits it, or by ``fallback`` when there is no such pool or it is exhausted.
+ * This gives pool-speed allocations for mixed sizes, without callers having to know about the pools' geometry.
+ *
+ * .. code-block:: c
+ *
+ *     static memory_pool_t small, medium;
+ *     // ... chPoolObjectInit + chPoolLoadArray
+ *
+ *     static ch_multipool_slot_t slots[] = {
+ *         {.pool = &small},
+ *         {.pool = &medium},
+ *     };
+ *
+ *     static ch_multipool_t multipool_state = {
+ *         .slots    = slots,
+ *         .n_slots  = ARRAY_SIZE(slots),
+ *         .fallback = &heap_allocator,
+ *     };
+ *
+ *     const allocator_t multipool = new_ch_multipool_allocator(&multipool_state, "multipool");
+ *
+ * .. note::
+ *   Each block has an overhead of 8 bytes, to store where it came from. Size your pools' objects accordingly.
+ */
+typedef struct {
+    /**
+     * Pools to be used, in any order.
+     */
+    ch_multipool_slot_t *const slots;
+
+    /**
+     * Number of elements in ``slots``.
+     */
+    const size_t n_slots;
+
+    /**
+     * Allocator used when no pool can serve a request. May be ``NULL``.
+     */
+    const allocator_t *const fallback;
+
+    /**
+     * Blocks currently handed out from ``fallback``.
+     */
+    size_t fallback_used;
+} ch_multipool_t;
+
+/**
+ * Create a new allocator dispatching requests to several ChibiOS' pools.
+ *
+ * .. warning::
+ *   At most 254 pools can be used. With more of them, the allocator is returned without functions, and every
+ *   operation on it fails.
+ */
+const allocator_t new_ch_multipool_allocator(ch_multipool_t *state, const char *name);
 #    endif
 
 #    if CH_CFG_USE_HEAP == TRUE || defined(__SPHINX__)
@@ -196,6 +807,55 @@ const allocator_t new_ch_pool_allocator(memory_pool_t *pool, const char *name);
  * Create a new ChibiOS' heap allocator.
  */
 const allocator_t new_ch_heap_allocator(memory_heap_t *heap, const char *name);
+
+/**
+ * Information about how fragmented a ChibiOS' heap is.
+ */
+typedef struct {
+    /**
+     * Total free space.
+     */
+    size_t free;
+
+    /**
+     * Size of the biggest free block, ie: largest request that can be served.
+     */
+    size_t largest;
+
+    /**
+     * Number of free blocks.
+     */
+    size_t free_blocks;
+
+    /**
+     * Space used by the (tracked) allocations served by this heap.
+     */
+    size_t used;
+
+    /**
+     * Number of (tracked) allocations served by this heap.
+     */
+    size_t used_blocks;
+
+    /**
+     * Percentage of the free space that is not part of the biggest block.
+     *
+     * ``0`` means all free space is contiguous, values close to ``100`` mean it is split in many small blocks.
+     */
+    uint8_t index;
+} heap_fragmentation_t;
+
+/**
+ * Walk a ChibiOS' heap, and the allocations tracked for it, to find out how fragmented it is.
+ *
+ * Args:
+ *     heap: Heap to be inspected, ``NULL`` for ChibiOS' default one.
+ *     frag: Where to write the information.
+ *
+ * .. note::
+ *   Space that the heap could still get from its provider (eg: core allocator for the default heap) is not accounted for.
+ */
+void get_heap_fragmentation(memory_heap_t *heap, heap_fragmentation_t *frag);
 #    endif
 #endif
 
@@ -211,4 +871,47 @@ STATIC_ASSERT(offsetof(heap_args_t, font) == 0, "UI will crash :)");
 
 bool      heap_init(ui_node_t *self);
 ui_time_t heap_render(const ui_node_t *self, painter_device_t display);
+
+// How many pixels (at most) can be drawn by a heap map.
+#    ifndef ALLOC_HEAP_MAP_WIDTH
+#        define ALLOC_HEAP_MAP_WIDTH (240)
+#    endif
+
+/**
+ * Configuration of a heap map, a bar where each pixel represents ``N`` bytes of a memory region.
+ *
+ * Pixels overlapping with a (tracked) allocation are drawn red, green otherwise.
+ * Only the spans that changed since last time are redrawn.
+ *
+ * .. code-block:: c
+ *
+ *     static heap_map_args_t heap_map_args = {
+ *         .start    = tlsf_buffer,
+ *         .size     = sizeof(tlsf_buffer),
+ *         .interval = UI_SECONDS(1),
+ *     };
+ */
+typedef struct {
+    /**
+     * First address of the region.
+     */
+    const void *start;
+
+    /**
+     * Size of the region.
+     */
+    size_t size;
+
+    /**
+     * How often to redraw.
+     */
+    ui_time_t interval;
+
+    // internal state
+    bool    drawn;
+    uint8_t last[(ALLOC_HEAP_MAP_WIDTH + 7) / 8];
+} heap_map_args_t;
+
+bool      heap_map_init(ui_node_t *self);
+ui_time_t heap_map_render(const ui_node_t *self, painter_device_t display);
 #endif
@@ -12,3 +12,5 @@ ifeq ($(strip $(ALLOCATOR_WRAP_STD)), yes)
 else
     OPT_DEFS += -DALLOCATOR_WRAP_STD=0
 endif
+
+SRC += $(MODULE_PATH_ALLOCATOR)/tlsf.c
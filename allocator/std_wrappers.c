@@ -3,18 +3,19 @@
 
 #include "elpekenin/allocator.h"
 
-void *__wrap_malloc(size_t total_size) {
-    return malloc_with(c_runtime_allocator, total_size);
+// wrappers must not be inlined (eg: LTO), `__builtin_return_address` would point to the caller's caller
+__attribute__((noinline)) void *__wrap_malloc(size_t total_size) {
+    return _malloc_with(c_runtime_allocator, total_size, __builtin_return_address(0));
 }
 
 void __wrap_free(void *ptr) {
     return free_with(c_runtime_allocator, ptr);
 }
 
-void *__wrap_calloc(size_t nmemb, size_t size) {
-    return calloc_with(c_runtime_allocator, nmemb, size);
+__attribute__((noinline)) void *__wrap_calloc(size_t nmemb, size_t size) {
+    return _calloc_with(c_runtime_allocator, nmemb, size, __builtin_return_address(0));
 }
 
-void *__wrap_realloc(void *ptr, size_t size) {
-    return realloc_with(c_runtime_allocator, ptr, size);
+__attribute__((noinline)) void *__wrap_realloc(void *ptr, size_t size) {
+    return _realloc_with(c_runtime_allocator, ptr, size, __builtin_return_address(0));
 }
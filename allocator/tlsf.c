@@ -0,0 +1,383 @@
+// Copyright Pablo Martinez (@elpekenin) <elpekenin@elpekenin.dev>
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+// Two-Level Segregated Fit allocator, based on the paper by M. Masmano et al.
+// <http://www.gii.upv.es/tlsf/files/papers/ecrts04_tlsf.pdf>
+
+#include <string.h>
+
+#include "elpekenin/allocator.h"
+#include "quantum.h"
+
+#ifdef ALLOCATOR_DEBUG
+#    include "quantum/logging/debug.h"
+#    define allocator_dprintf dprintf
+#else
+#    define allocator_dprintf(...)
+#endif
+
+typedef struct tlsf_block_t tlsf_block_t;
+
+struct tlsf_block_t {
+    // block right before this one in memory, NULL for the first one
+    tlsf_block_t *prev_phys;
+
+    // size of the payload, lowest bit flags whether block is free
+    size_t size;
+
+    // only valid while the block is free, overlap with the payload otherwise
+    tlsf_block_t *next_free;
+    tlsf_block_t *prev_free;
+};
+
+#define BLOCK_FREE (1)
+
+#define BLOCK_ALIGN (1 << ALLOC_TLSF_ALIGN_LOG2)
+
+// bytes used by a block's header, before its payload
+#define BLOCK_OVERHEAD (offsetof(tlsf_block_t, next_free))
+
+// payload must be big enough to hold the links of the free lists
+#define BLOCK_SIZE_MIN (sizeof(tlsf_block_t) - BLOCK_OVERHEAD)
+
+// blocks smaller than this are all kept in the first first-level range
+#define SMALL_BLOCK_SIZE (1 << ALLOC_TLSF_FL_SHIFT)
+
+STATIC_ASSERT(BLOCK_OVERHEAD % BLOCK_ALIGN == 0, "Header would misalign payloads");
+STATIC_ASSERT(BLOCK_SIZE_MIN % BLOCK_ALIGN == 0, "Minimum size would misalign payloads");
+STATIC_ASSERT(ALLOC_TLSF_MIN_SIZE == 2 * BLOCK_OVERHEAD + BLOCK_SIZE_MIN, "ALLOC_TLSF_MIN_SIZE is out of date");
+
+//
+// Bit operations
+//
+
+// index of the most significant bit set, `x` must not be 0
+static inline uint8_t tlsf_fls(uint32_t x) {
+    return 31 - __builtin_clz(x);
+}
+
+// index of the least significant bit set, `x` must not be 0
+static inline uint8_t tlsf_ffs(uint32_t x) {
+    return __builtin_ctz(x);
+}
+
+//
+// Block helpers
+//
+
+static inline size_t block_size(const tlsf_block_t *block) {
+    return block->size & ~(size_t)BLOCK_FREE;
+}
+
+static inline void block_set_size(tlsf_block_t *block, size_t size) {
+    block->size = size | (block->size & BLOCK_FREE);
+}
+
+static inline bool block_is_free(const tlsf_block_t *block) {
+    return (block->size & BLOCK_FREE) != 0;
+}
+
+static inline void block_set_free(tlsf_block_t *block, bool free) {
+    if (free) {
+        block->size |= BLOCK_FREE;
+    } else {
+        block->size &= ~(size_t)BLOCK_FREE;
+    }
+}
+
+static inline void *block_to_ptr(tlsf_block_t *block) {
+    return (uint8_t *)block + BLOCK_OVERHEAD;
+}
+
+static inline tlsf_block_t *block_from_ptr(void *ptr) {
+    return (tlsf_block_t *)((uint8_t *)ptr - BLOCK_OVERHEAD);
+}
+
+static inline tlsf_block_t *block_next(tlsf_block_t *block) {
+    return (tlsf_block_t *)((uint8_t *)block_to_ptr(block) + block_size(block));
+}
+
+// payload size to be used for a request of `size` bytes
+static inline size_t adjust_size(size_t size) {
+    const size_t aligned = (size + BLOCK_ALIGN - 1) & ~(size_t)(BLOCK_ALIGN - 1);
+    return MAX(aligned, BLOCK_SIZE_MIN);
+}
+
+//
+// Size <-> lists mapping
+//
+
+// list where a block of `size` bytes belongs
+static void mapping_insert(size_t size, uint8_t *fl, uint8_t *sl) {
+    if (size < SMALL_BLOCK_SIZE) {
+        *fl = 0;
+        *sl = size / (SMALL_BLOCK_SIZE / ALLOC_TLSF_SL_COUNT);
+        return;
+    }
+
+    const uint8_t msb = tlsf_fls(size);
+
+    *fl = msb - (ALLOC_TLSF_FL_SHIFT - 1);
+    *sl = (size >> (msb - ALLOC_TLSF_SL_LOG2)) ^ ALLOC_TLSF_SL_COUNT;
+}
+
+// first list whose blocks are all big enough for `size` bytes
+static void mapping_search(size_t size, uint8_t *fl, uint8_t *sl) {
+    if (size >= SMALL_BLOCK_SIZE) {
+        size += (1 << (tlsf_fls(size) - ALLOC_TLSF_SL_LOG2)) - 1;
+    }
+
+    mapping_insert(size, fl, sl);
+}
+
+//
+// Free lists
+//
+
+static void insert_free_block(tlsf_t *tlsf, tlsf_block_t *block) {
+    uint8_t fl, sl;
+    mapping_insert(block_size(block), &fl, &sl);
+
+    tlsf_block_t *head = tlsf->blocks[fl][sl];
+
+    block->next_free = head;
+    block->prev_free = NULL;
+    if (head != NULL) {
+        head->prev_free = block;
+    }
+
+    tlsf->blocks[fl][sl] = block;
+    tlsf->fl_bitmap |= 1u << fl;
+    tlsf->sl_bitmap[fl] |= 1u << sl;
+
+    block_set_free(block, true);
+}
+
+static void remove_free_block(tlsf_t *tlsf, tlsf_block_t *block) {
+    uint8_t fl, sl;
+    mapping_insert(block_size(block), &fl, &sl);
+
+    if (block->next_free != NULL) {
+        block->next_free->prev_free = block->prev_free;
+    }
+
+    if (block->prev_free != NULL) {
+        block->prev_free->next_free = block->next_free;
+    }
+
+    // list is now empty, update bitmaps
+    if (tlsf->blocks[fl][sl] == block) {
+        tlsf->blocks[fl][sl] = block->next_free;
+
+        if (block->next_free == NULL) {
+            tlsf->sl_bitmap[fl] &= ~(1u << sl);
+
+            if (tlsf->sl_bitmap[fl] == 0) {
+                tlsf->fl_bitmap &= ~(1u << fl);
+            }
+        }
+    }
+
+    block_set_free(block, false);
+}
+
+// first free block in the list for (fl, sl) or any bigger one
+static tlsf_block_t *find_suitable_block(tlsf_t *tlsf, uint8_t fl, uint8_t sl) {
+    uint32_t sl_map = tlsf->sl_bitmap[fl] & (~0u << sl);
+
+    if (sl_map == 0) {
+        // no block in this first-level range, look in bigger ones
+        const uint32_t fl_map = tlsf->fl_bitmap & (~0u << (fl + 1));
+        if (fl_map == 0) {
+            return NULL;
+        }
+
+        fl     = tlsf_ffs(fl_map);
+        sl_map = tlsf->sl_bitmap[fl];
+    }
+
+    sl = tlsf_ffs(sl_map);
+    return tlsf->blocks[fl][sl];
+}
+
+//
+// Splitting and merging
+//
+
+static inline bool can_split(const tlsf_block_t *block, size_t size) {
+    return block_size(block) >= size + BLOCK_OVERHEAD + BLOCK_SIZE_MIN;
+}
+
+// trim `block` to `size` bytes, returning the (used) block holding the remaining space
+static tlsf_block_t *split_block(tlsf_block_t *block, size_t size) {
+    tlsf_block_t *rest = (tlsf_block_t *)((uint8_t *)block_to_ptr(block) + size);
+
+    rest->size                  = block_size(block) - size - BLOCK_OVERHEAD;
+    rest->prev_phys             = block;
+    block_next(rest)->prev_phys = rest;
+
+    block_set_size(block, size);
+
+    return rest;
+}
+
+// merge `block` with the next one (if it is free)
+static void merge_next(tlsf_t *tlsf, tlsf_block_t *block) {
+    tlsf_block_t *next = block_next(block);
+    if (!block_is_free(next)) {
+        return;
+    }
+
+    remove_free_block(tlsf, next);
+    block_set_size(block, block_size(block) + BLOCK_OVERHEAD + block_size(next));
+    block_next(block)->prev_phys = block;
+}
+
+// merge `block` with the previous one (if it is free), returns the resulting block
+static tlsf_block_t *merge_prev(tlsf_t *tlsf, tlsf_block_t *block) {
+    tlsf_block_t *prev = block->prev_phys;
+    if (prev == NULL || !block_is_free(prev)) {
+        return block;
+    }
+
+    remove_free_block(tlsf, prev);
+    block_set_size(prev, block_size(prev) + BLOCK_OVERHEAD + block_size(block));
+    block_next(prev)->prev_phys = prev;
+
+    return prev;
+}
+
+// give the space after `size` bytes back to the free lists, if it's big enough for a block
+static void trim_block(tlsf_t *tlsf, tlsf_block_t *block, size_t size) {
+    if (!can_split(block, size)) {
+        return;
+    }
+
+    tlsf_block_t *rest = split_block(block, size);
+    merge_next(tlsf, rest);
+    insert_free_block(tlsf, rest);
+}
+
+//
+// Setup
+//
+
+static void tlsf_init(tlsf_t *tlsf) {
+    // buffer is a single free block, followed by a zero-sized (used) sentinel that stops merges
+    const size_t size = (tlsf->size - 2 * BLOCK_OVERHEAD) & ~(size_t)(BLOCK_ALIGN - 1);
+
+    tlsf_block_t *block = (tlsf_block_t *)tlsf->buffer;
+    block->prev_phys    = NULL;
+    block->size         = size;
+
+    tlsf_block_t *sentinel = block_next(block);
+    sentinel->prev_phys    = block;
+    sentinel->size         = 0;
+
+    insert_free_block(tlsf, block);
+
+    tlsf->initialized = true;
+}
+
+//
+// Allocator's vtable
+//
+
+static void tlsf_free(const allocator_t *allocator, void *ptr) {
+    tlsf_t *const tlsf = (tlsf_t *)allocator->arg;
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    tlsf_block_t *block = block_from_ptr(ptr);
+    if (block_is_free(block)) {
+        allocator_dprintf("[ERROR] %s: double free (%p)\n", __func__, ptr);
+        return;
+    }
+
+    merge_next(tlsf, block);
+    block = merge_prev(tlsf, block);
+    insert_free_block(tlsf, block);
+}
+
+static void *tlsf_malloc(const allocator_t *allocator, size_t size) {
+    tlsf_t *const tlsf = (tlsf_t *)allocator->arg;
+
+    if (!tlsf->initialized) {
+        tlsf_init(tlsf);
+    }
+
+    if (size == 0 || size > tlsf->size) {
+        allocator_dprintf("[ERROR] %s: invalid size (%d)\n", __func__, (int)size);
+        return NULL;
+    }
+
+    const size_t adjusted = adjust_size(size);
+
+    uint8_t fl, sl;
+    mapping_search(adjusted, &fl, &sl);
+    if (fl >= ALLOC_TLSF_FL_COUNT) {
+        return NULL;
+    }
+
+    tlsf_block_t *block = find_suitable_block(tlsf, fl, sl);
+    if (block == NULL) {
+        allocator_dprintf("[ERROR] %s: out of memory\n", __func__);
+        return NULL;
+    }
+
+    remove_free_block(tlsf, block);
+    trim_block(tlsf, block, adjusted);
+
+    return block_to_ptr(block);
+}
+
+static void *tlsf_realloc(const allocator_t *allocator, void *ptr, size_t size) {
+    tlsf_t *const tlsf = (tlsf_t *)allocator->arg;
+
+    if (size > tlsf->size) {
+        allocator_dprintf("[ERROR] %s: invalid size (%d)\n", __func__, (int)size);
+        return NULL;
+    }
+
+    tlsf_block_t *block    = block_from_ptr(ptr);
+    tlsf_block_t *next     = block_next(block);
+    const size_t  current  = block_size(block);
+    const size_t  adjusted = adjust_size(size);
+
+    // grow in place by taking over the next block
+    const bool fits_in_place = block_is_free(next) && current + BLOCK_OVERHEAD + block_size(next) >= adjusted;
+
+    if (adjusted > current && !fits_in_place) {
+        // last resort: move the data elsewhere
+        void *new_ptr = tlsf_malloc(allocator, size);
+        if (new_ptr == NULL) {
+            return NULL;
+        }
+
+        memcpy(new_ptr, ptr, current);
+        tlsf_free(allocator, ptr);
+
+        return new_ptr;
+    }
+
+    if (adjusted > current) {
+        merge_next(tlsf, block);
+    }
+
+    // shrink (or drop the excess from the merge)
+    trim_block(tlsf, block, adjusted);
+
+    return ptr;
+}
+
+const allocator_t new_tlsf_allocator(tlsf_t *tlsf, const char *name) {
+    return (allocator_t){
+        .free    = tlsf_free,
+        .malloc  = tlsf_malloc,
+        .realloc = tlsf_realloc,
+        .name    = name,
+        .arg     = tlsf,
+    };
+}
@@ -18,15 +18,105 @@
 
 #include <errno.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "compiler_support.h"
 #include "printf/printf.h" // ATTR_PRINTF
 
+/**
+ * Kind of element in the logging format.
+ */
+typedef enum {
+    /** */
+    LOG_SEGMENT_TEXT,
+    /** */
+    LOG_SEGMENT_LEVEL_LONG,
+    /** */
+    LOG_SEGMENT_LEVEL_SHORT,
+    /** */
+    LOG_SEGMENT_MESSAGE,
+    /** */
+    LOG_SEGMENT_TIME,
+    /** */
+    LOG_SEGMENT_TIME_DELTA,
+} log_segment_type_t;
+
+/**
+ * An element of the logging format.
+ */
+typedef struct {
+    /**
+     * What this segment represents.
+     */
+    log_segment_type_t type;
+
+    /**
+     * Literal text, only used by :c:enumerator:`LOG_SEGMENT_TEXT`.
+     */
+    const char *text;
+} log_segment_t;
+
+/**
+ * Literal text. Must be a string literal.
+ */
+#define LOG_TEXT(str)             \
+    {                             \
+        .type = LOG_SEGMENT_TEXT, \
+        .text = "" str "",        \
+    }
+
+/**
+ * The message's level (long). Eg: ``DEBUG``.
+ *
+ * These strings are set in ``level_str``.
+ */
+#define LOG_LEVEL_LONG                  \
+    {                                   \
+        .type = LOG_SEGMENT_LEVEL_LONG, \
+    }
+
+/**
+ * Only the first char of the previous string. Eg: ``D``.
+ */
+#define LOG_LEVEL_SHORT                  \
+    {                                    \
+        .type = LOG_SEGMENT_LEVEL_SHORT, \
+    }
+
+/**
+ * The actual message created by ``msg`` and ``...`` passed to :c:func:`logging`. With its regular format.
+ */
+#define LOG_MESSAGE                  \
+    {                                \
+        .type = LOG_SEGMENT_MESSAGE, \
+    }
+
+/**
+ * Current time, you can override :c:func:`log_time` to hook it with a RTC or whatever.
+ *
+ * Default implementation is seconds since boot, with microsecond resolution. Eg: ``12.345678``.
+ */
+#define LOG_TIME                  \
+    {                             \
+        .type = LOG_SEGMENT_TIME, \
+    }
+
+/**
+ * Time elapsed since the previous message, in seconds with microsecond resolution. Eg: ``+0.001250``.
+ *
+ * Useful to measure latencies (eg: key processing) straight from the logs.
+ */
+#define LOG_TIME_DELTA                  \
+    {                                   \
+        .type = LOG_SEGMENT_TIME_DELTA, \
+    }
+
 #ifndef LOGGING_FORMAT
 /**
  * Default format for logging messages.
  */
-#    define LOGGING_FORMAT "[%LS] %M"
+#    define LOGGING_FORMAT LOG_TEXT("["), LOG_LEVEL_SHORT, LOG_TEXT("] "), LOG_MESSAGE
 #endif
 
 /**
@@ -51,19 +141,11 @@ typedef enum {
 /**
  * .. hint::
  *   The :c:func:`logging` function will apply an extra transformation to your input, based on a custom format.
- *   Its specifiers being:
- *
- *   * ``%LL``: The message's level (long). Eg: ``DEBUG``.
  *
- *     * These strings are set in ``level_str``.
- *   * ``%LS``: Print only the first char of the previous string. Eg: ``D``.
- *   * ``%M``: The actual message created by ``msg`` and ``...`` passed to :c:func:`logging`. With its regular format.
- *   * ``%T``: Current time, you can override :c:func:`log_time` to hook it with a RTC or whatever.
+ *   ``LOGGING_FORMAT`` is a comma-separated list of the segments above, it gets turned into a table at compile time.
+ *   Thus, an invalid format is a compilation error, and there is no parsing when emitting messages.
  *
- *     * Default implementation is seconds since boot.
- *   * ``%%``: Write a literal ``%``.
- *
- *   For example, with format of ``[%LL] %T -- %M``, messages would look like: ``[DEBUG] 3s -- Formatted message``
+ *   For example, with ``#define LOGGING_FORMAT LOG_TEXT("["), LOG_LEVEL_LONG, LOG_TEXT("] "), LOG_TIME, LOG_TEXT(" -- "), LOG_MESSAGE``, messages would look like: ``[DEBUG] 3.141592 -- Formatted message``
  */
 
 /**
@@ -76,21 +158,435 @@ typedef enum {
  *
  * Return: Error code.
  *    * ``0``: Message handled correctly (maybe ignored due to settings).
- *    * ``-EBUSY``: Could not acquire the mutex guarding this function.
- *    * ``-EINVAL``: Logging format is wrong. Following calls will behave as usual ``printf``, returning 0.
+ *    * ``-ENOBUFS``: Queue is full, message was dropped.
+ *
+ * .. note::
+ *   Messages are formatted by the caller, but they are queued and sent to the sinks later, from ``housekeeping_task``.
+ *   This function can be used from both cores and from ISRs, callers never wait for each other nor for the console.
+ *
+ * .. note::
+ *   When deferred logging is enabled, this is a macro expanding to :c:func:`log_deferred`.
  */
-ATTR_PRINTF(2, 3) int logging(log_level_t level, const char *msg, ...);
+ATTR_PRINTF(2, 3) int(logging)(log_level_t level, const char *msg, ...);
 
-typedef enum {
-    STR_END,
-    NO_SPEC,
-    INVALID_SPEC,
-    LL_SPEC,
-    LS_SPEC,
-    M_SPEC,
-    PERC_SPEC,
-    T_SPEC,
-} token_t;
+// How many messages can be queued, waiting to be printed.
+#ifndef LOGGING_QUEUE_SIZE
+#    define LOGGING_QUEUE_SIZE (16)
+#endif
+
+// How long (at most) a message can be, longer ones get truncated.
+#ifndef LOGGING_MESSAGE_SIZE
+#    define LOGGING_MESSAGE_SIZE (96)
+#endif
+
+// How many arguments (at most) a deferred message can have.
+#define LOGGING_MAX_ARGS (6)
+
+/**
+ * A queued message.
+ */
+typedef struct PACKED {
+    /**
+     * Address of the format string.
+     */
+    const char *msg;
+
+    /**
+     * When the message was emitted, in microseconds. See :c:func:`log_timestamp`.
+     */
+    uint32_t timestamp;
+
+    /**
+     * Severity of the message.
+     */
+    uint8_t level;
+
+#if defined(LOGGING_DEFERRED) || defined(__SPHINX__)
+    /**
+     * Number of elements in ``args``.
+     */
+    uint8_t n_args;
+
+    /**
+     * Arguments to fill the specifiers in ``msg``. Only on deferred mode.
+     */
+    uint32_t args[LOGGING_MAX_ARGS];
+#endif
+
+#if !defined(LOGGING_DEFERRED) || defined(__SPHINX__)
+    /**
+     * Microseconds elapsed since the previous message. Only when deferred mode is disabled.
+     */
+    uint32_t delta;
+
+    /**
+     * Formatted message. Only when deferred mode is disabled.
+     */
+    char text[LOGGING_MESSAGE_SIZE];
+#endif
+} log_record_t;
+
+/**
+ * Get how many messages have been dropped because the queue was full.
+ */
+uint32_t get_dropped_logs(void);
+
+//
+// Flood protection
+//
+
+// How many call sites (format strings) are tracked for rate limiting.
+#ifndef LOGGING_RATE_LIMIT_SLOTS
+#    define LOGGING_RATE_LIMIT_SLOTS (8)
+#endif
+
+// How many messages a call site can emit in a burst.
+#ifndef LOGGING_RATE_LIMIT_BURST
+#    define LOGGING_RATE_LIMIT_BURST (8)
+#endif
+
+// How often (in milliseconds) a call site gets back one of its messages.
+#ifndef LOGGING_RATE_LIMIT_PERIOD
+#    define LOGGING_RATE_LIMIT_PERIOD (100)
+#endif
+
+// How often (in milliseconds) the amount of repetitions is reported, while a message keeps repeating.
+#ifndef LOGGING_REPEATED_INTERVAL
+#    define LOGGING_REPEATED_INTERVAL (1000)
+#endif
+
+/**
+ * Get how many messages have been discarded by rate limiting.
+ *
+ * .. note::
+ *   Each call site (format string) has a budget of :c:macro:`LOGGING_RATE_LIMIT_BURST` messages, getting one back every
+ *   :c:macro:`LOGGING_RATE_LIMIT_PERIOD` milliseconds. Messages over it are discarded.
+ *
+ *   Besides, a message identical to the previous one is not queued. Instead, a ``last message repeated N times`` line
+ *   is emitted once a different message comes (or every :c:macro:`LOGGING_REPEATED_INTERVAL` milliseconds).
+ */
+uint32_t get_rate_limited_logs(void);
+
+//
+// Sinks
+//
+
+// How many sinks can be registered.
+#ifndef LOGGING_SINKS_SIZE
+#    define LOGGING_SINKS_SIZE (4)
+#endif
+
+// How long (at most) a line can be, when formatting a message.
+#ifndef LOGGING_LINE_SIZE
+#    define LOGGING_LINE_SIZE (LOGGING_MESSAGE_SIZE + 32)
+#endif
+
+typedef struct log_sink_t log_sink_t;
+
+/**
+ * A destination for the messages.
+ *
+ * Every message is sent to all registered sinks, from ``housekeeping_task`` (unless they are ``immediate``).
+ * Each sink keeps its own position in the queue, thus a slow one does not stall the others.
+ *
+ * .. code-block:: c
+ *
+ *     static void write(log_sink_t *sink, const log_record_t *record) {
+ *         char line[LOGGING_LINE_SIZE];
+ *         log_format_record(record, line, sizeof(line));
+ *         // ... send it somewhere
+ *     }
+ *
+ *     static log_sink_t my_sink = {
+ *         .name   = "mine",
+ *         .write  = write,
+ *         .budget = 100,
+ *     };
+ *
+ *     void keyboard_post_init_user(void) {
+ *         log_sink_register(&my_sink);
+ *     }
+ */
+struct log_sink_t {
+    /**
+     * Name of the sink.
+     */
+    const char *const name;
+
+    /**
+     * Handle a message.
+     */
+    void (*const write)(log_sink_t *sink, const log_record_t *record);
+
+    /**
+     * How long (in microseconds) this sink can take on each housekeeping.
+     *
+     * At least one message is handled every time, regardless of this value.
+     */
+    const uint32_t budget;
+
+    /**
+     * Write each message as soon as it is complete, from the code logging it, instead of on ``housekeeping_task``.
+     *
+     * ``write`` is then called with interrupts disabled (from either core or an ISR), it has to be short and must
+     * not block. ``budget`` is not used.
+     */
+    const bool immediate;
+
+    /**
+     * Position on the queue, used internally.
+     */
+    uint32_t tail;
+};
+
+/**
+ * Start sending messages to a sink.
+ *
+ * Return: Error code.
+ *    * ``0``: Sink registered.
+ *    * ``-ENOMEM``: Too many sinks.
+ */
+int log_sink_register(log_sink_t *sink);
+
+/**
+ * Build the text of a message, based on ``LOGGING_FORMAT`` (or hexadecimal words, in deferred mode).
+ *
+ * Return: Length of the text written into ``buffer`` (always null-terminated).
+ */
+size_t log_format_record(const log_record_t *record, char *buffer, size_t size);
+
+/**
+ * Sink writing to QMK's console. Registered by default.
+ */
+extern log_sink_t console_log_sink;
+
+// How much memory is used by the RAM sink.
+#ifndef LOGGING_RAM_SIZE
+#    define LOGGING_RAM_SIZE (2048)
+#endif
+
+/**
+ * Sink storing the latest messages in a RAM buffer, in a compact binary form.
+ *
+ * When full, oldest messages are overwritten. Messages are stored as soon as they are logged (see
+ * :c:member:`log_sink_t.immediate`), the ones right before a crash are not lost waiting for housekeeping.
+ *
+ * .. hint::
+ *   If ``crash`` module is enabled, the buffer is not cleared on (re)boot. It is checksummed and recovered instead.
+ *   This way, the messages that lead to a crash can be printed after it.
+ *
+ *   .. code-block:: c
+ *
+ *     crash_info_t info;
+ *     if (get_crash(&info) && ram_logs_recovered()) {
+ *         print_ram_logs();
+ *     }
+ */
+extern log_sink_t ram_log_sink;
+
+/**
+ * Print the messages stored by :c:var:`ram_log_sink`, oldest first.
+ */
+void print_ram_logs(void);
+
+/**
+ * Whether messages from a previous execution were found (and are valid) on boot.
+ */
+bool ram_logs_recovered(void);
+
+// Not intended to be used by users -> no docstring
+void ram_log_recover(void);
+
+// How many tags can be registered, to change their level at runtime.
+#ifndef LOGGING_TAGS_SIZE
+#    define LOGGING_TAGS_SIZE (16)
+#endif
+
+// How long (at most) a tag's name can be, to set its level before it is used.
+#ifndef LOGGING_TAG_NAME_SIZE
+#    define LOGGING_TAG_NAME_SIZE (16)
+#endif
+
+/**
+ * State of a tag, created by :c:macro:`LOG_TAG`.
+ */
+typedef struct {
+    /**
+     * Name of the tag.
+     */
+    const char *const name;
+
+    /**
+     * Level of this tag, only used if ``has_level``. Global level is used otherwise.
+     */
+    log_level_t level;
+
+    /**
+     * Whether this tag has its own level.
+     */
+    bool has_level;
+
+    /**
+     * Whether this tag has been registered (happens the first time it is used).
+     */
+    bool registered;
+} log_tag_t;
+
+/**
+ * .. hint::
+ *   Messages can be grouped by tags (eg: one per module), each of them with its own level.
+ *
+ *   .. code-block:: c
+ *
+ *     // at file scope, messages below LOG_INFO are removed at compile time
+ *     LOG_TAG(ui, LOG_INFO);
+ *
+ *     void foo(void) {
+ *         logging_tagged(ui, LOG_DEBUG, "not even compiled");
+ *         logging_tagged(ui, LOG_WARN, "hello");
+ *     }
+ *
+ *   The compile-time floor is a constant, thus calls below it (along with their arguments and format string) are optimized out.
+ *   It is advised to read it from a macro, which can be set in ``config.h``.
+ *
+ *   Levels can also be changed at runtime with :c:func:`set_logging_tag_level`, by default tags follow the global level.
+ */
+
+/**
+ * Create a tag, to be used by :c:macro:`logging_tagged` on the same file.
+ *
+ * Args:
+ *     tag: Name of the tag, as an identifier (not a string).
+ *     floor: Messages with a lower severity are removed at compile time.
+ */
+#define LOG_TAG(tag, floor)                 \
+    enum { log_tag_floor_##tag = (floor) }; \
+    static log_tag_t log_tag_##tag = {      \
+        .name = #tag,                       \
+    }
+
+/**
+ * Change the level of every tag named ``name``.
+ *
+ * Tags are registered the first time they are used. The level is also remembered, and applied to tags registered
+ * afterwards, thus it can be set on boot (eg: ``keyboard_post_init_user``).
+ *
+ * Return: Error code.
+ *    * ``0``: Level changed (or will be, once the tag is used).
+ *    * ``-EINVAL``: Invalid level, or ``name`` is longer than ``LOGGING_TAG_NAME_SIZE - 1``.
+ *    * ``-ENOMEM``: No tag named ``name`` yet, and too many levels are remembered already.
+ */
+int set_logging_tag_level(const char *name, log_level_t level);
+
+/**
+ * Make every tag named ``name`` follow the global level again.
+ *
+ * Return: Error code.
+ *    * ``0``: Level changed.
+ *    * ``-ENOENT``: No such tag (maybe it was not used yet).
+ */
+int reset_logging_tag_level(const char *name);
+
+/**
+ * Emit a logging message with a tag. Same as :c:func:`logging` otherwise.
+ *
+ * Not intended to be called directly, use :c:macro:`logging_tagged`.
+ */
+ATTR_PRINTF(3, 4) int log_tagged(log_tag_t *tag, log_level_t level, const char *msg, ...);
+
+#if defined(LOGGING_DEFERRED) || defined(__SPHINX__)
+/**
+ * .. hint::
+ *   Add ``#define LOGGING_DEFERRED`` to your ``config.h`` to defer formatting of messages to the host.
+ *
+ *   In this mode, :c:func:`logging` does not format anything. Instead, it stores the address of ``msg``, the level, a timestamp (in microseconds) and the (raw) arguments in a queue.
+ *   This is cheap enough to be used anywhere, eg: while processing keys.
+ *
+ *   Then, messages are printed from ``housekeeping_task``, one per line, as hexadecimal words: ``[LOG] <msg> <level> <timestamp> <args>...``.
+ *   A program on the computer can find the format string in the firmware's ELF file, and build the text.
+ *
+ *   Limitations:
+ *
+ *   * At most :c:macro:`LOGGING_MAX_ARGS` arguments.
+ *   * Arguments are stored as 32-bit integers. Use integers and pointers, no floating point.
+ *   * Strings (``%s``) are stored as pointers, so they must point to flash (eg: literals) to be readable by the host.
+ *   * Same goes for ``msg``, which must be a string literal. This is enforced by the macros, a variable fails to build.
+ *     Calling the function itself (``(logging)(...)``) skips the check, only do it with strings in flash.
+ */
+
+/**
+ * Queue a message, to be printed later.
+ *
+ * Args:
+ *     tag: Tag of the message, ``NULL`` if none.
+ *     level: Severity of the message.
+ *     msg: Format string for the message.
+ *     n_args: Number of elements in ``args``.
+ *     args: Arguments to fill the specifiers in ``msg``.
+ *
+ * Return: Error code.
+ *    * ``0``: Message handled correctly (maybe ignored due to settings).
+ *    * ``-ENOBUFS``: Queue is full, message was dropped.
+ */
+int log_deferred(log_tag_t *tag, log_level_t level, const char *msg, size_t n_args, const uint32_t *args);
+
+// Not intended to be used by users -> no docstring
+#    define _LOG_NARGS(_0, _1, _2, _3, _4, _5, _6, _7, N, ...) N
+#    define LOG_NARGS(...) _LOG_NARGS(_, ##__VA_ARGS__, LOGGING_TOO_MANY_ARGS, 6, 5, 4, 3, 2, 1, 0)
+
+#    define LOG_WORD(x) (uint32_t)(uintptr_t)(x)
+#    define LOG_WORDS_0()
+#    define LOG_WORDS_1(a) LOG_WORD(a)
+#    define LOG_WORDS_2(a, b) LOG_WORD(a), LOG_WORD(b)
+#    define LOG_WORDS_3(a, b, c) LOG_WORD(a), LOG_WORD(b), LOG_WORD(c)
+#    define LOG_WORDS_4(a, b, c, d) LOG_WORD(a), LOG_WORD(b), LOG_WORD(c), LOG_WORD(d)
+#    define LOG_WORDS_5(a, b, c, d, e) LOG_WORD(a), LOG_WORD(b), LOG_WORD(c), LOG_WORD(d), LOG_WORD(e)
+#    define LOG_WORDS_6(a, b, c, d, e, f) LOG_WORD(a), LOG_WORD(b), LOG_WORD(c), LOG_WORD(d), LOG_WORD(e), LOG_WORD(f)
+#    define _LOG_WORDS(n, ...) LOG_WORDS_##n(__VA_ARGS__)
+#    define LOG_WORDS(n, ...) _LOG_WORDS(n, ##__VA_ARGS__)
+
+// never defined, only used (unevaluated) to get format warnings on deferred messages
+ATTR_PRINTF(1, 2) int log_check_format(const char *msg, ...);
+
+// only its address is stored, it has to outlive the message (ie: be in flash)
+// concatenation only builds with string literals
+#    define LOG_LITERAL(msg) ("" msg "")
+
+#    define LOG_DEFERRED(tag, level, msg, ...)                              \
+        ((void)sizeof(log_check_format(msg, ##__VA_ARGS__)),                \
+         log_deferred(tag, level, LOG_LITERAL(msg), LOG_NARGS(__VA_ARGS__), \
+                      (const uint32_t[LOGGING_MAX_ARGS + 1]){               \
+                          LOG_WORDS(LOG_NARGS(__VA_ARGS__), ##__VA_ARGS__)  \
+                      }))
+
+#    define logging(level, msg, ...) LOG_DEFERRED(NULL, level, msg, ##__VA_ARGS__)
+#endif
+
+/**
+ * Emit a logging message with a tag, created by :c:macro:`LOG_TAG`.
+ *
+ * Args:
+ *     tag: Name of the tag, as an identifier (not a string).
+ *     level: Severity of the message.
+ *     msg: Format string for the message.
+ *     ...: Variadic arguments to fill the specifiers in ``msg``.
+ *
+ * Return: Same as :c:func:`logging`. ``0`` if message is below the compile-time floor.
+ */
+#if defined(LOGGING_DEFERRED)
+#    define LOG_TAGGED(tag, level, msg, ...) LOG_DEFERRED(tag, level, msg, ##__VA_ARGS__)
+#else
+#    define LOG_TAGGED(tag, level, msg, ...) log_tagged(tag, level, msg, ##__VA_ARGS__)
+#endif
+
+#define logging_tagged(tag, level, msg, ...)                               \
+    ({                                                                     \
+        int __ret = 0;                                                     \
+        if ((int)(level) >= (int)log_tag_floor_##tag) {                    \
+            __ret = LOG_TAGGED(&log_tag_##tag, level, msg, ##__VA_ARGS__); \
+        }                                                                  \
+        __ret;                                                             \
+    })
 
 /**
  * Get the current level.
@@ -125,11 +621,24 @@ void step_logging_level(bool increase);
 log_level_t get_current_message_level(void);
 
 /**
- * Get a string representing the current time.
+ * Get the current time, in microseconds. Used to timestamp messages.
+ *
+ * By default, RP2040's timer (or ChibiOS' system time on other MCUs), but it can be overwritten.
+ *
+ * .. note::
+ *   Being 32 bits, it wraps around after ~71 minutes.
+ */
+uint32_t log_timestamp(void);
+
+/**
+ * Get a string representing the time at which a message was emitted.
  *
- * By default, seconds since boot, but it can be overwritten.
+ * By default, seconds since boot with microsecond resolution (no ``printf`` involved), but it can be overwritten.
+ *
+ * Args:
+ *     timestamp: Value of :c:func:`log_timestamp` when the message was emitted.
  */
-const char *log_time(void);
+const char *log_time(uint32_t timestamp);
 
 /**
  * Check that an array has as many elements as logging levels are defined.
@@ -137,3 +646,32 @@ const char *log_time(void);
  * If not, compilation will error out.
  */
 #define ASSERT_LEVELS(__array) STATIC_ASSERT(ARRAY_SIZE(__array) == LOG_NONE + 1, "Wrong size")
+
+#if defined(COMMUNITY_MODULE_UI_ENABLE) || defined(__SPHINX__)
+#    include "elpekenin/ui.h"
+
+// How many lines are kept by the scrollback sink.
+#    ifndef LOGGING_SCROLLBACK_LINES
+#        define LOGGING_SCROLLBACK_LINES (8)
+#    endif
+
+// How long (at most) each line in the scrollback can be.
+#    ifndef LOGGING_SCROLLBACK_LINE_SIZE
+#        define LOGGING_SCROLLBACK_LINE_SIZE (64)
+#    endif
+
+/**
+ * Sink storing the latest lines, to be drawn by :c:func:`log_terminal_render`.
+ */
+extern log_sink_t scrollback_log_sink;
+
+typedef struct {
+    const uint8_t *font;
+    ui_time_t      interval;
+    uint32_t       last;
+} log_terminal_args_t;
+STATIC_ASSERT(offsetof(log_terminal_args_t, font) == 0, "UI will crash :)");
+
+bool      log_terminal_init(ui_node_t *self);
+ui_time_t log_terminal_render(const ui_node_t *self, painter_device_t display);
+#endif
@@ -4,11 +4,11 @@
 #include "elpekenin/logging.h"
 
 #include <ch.h>
+#include <hal.h>
 #include <stdarg.h>
 #include <string.h>
 
 #include "quantum.h"
-#include "timer.h"
 
 // stringify log levels
 // clang-format off
@@ -65,138 +65,721 @@ void step_logging_level(bool increase) {
     }
 }
 
-// internals
-static token_t get_token(const char **str) {
-    if (**str == '\0') { // null terminator
-        return STR_END;
+//
+// Tags
+//
+
+static struct {
+    log_tag_t *ptr[LOGGING_TAGS_SIZE];
+    size_t     count;
+} tags = {0};
+
+// levels set by name, applied to tags registered afterwards
+static struct {
+    struct {
+        char        name[LOGGING_TAG_NAME_SIZE];
+        log_level_t level;
+    } ptr[LOGGING_TAGS_SIZE];
+    size_t count;
+} levels = {0};
+
+// position of `name` in `levels`, `levels.count` if not found
+static size_t find_level(const char *name) {
+    for (size_t i = 0; i < levels.count; ++i) {
+        if (strcmp(levels.ptr[i].name, name) == 0) {
+            return i;
+        }
     }
 
-    if (**str != '%') { // no specifier, regular text
-        return NO_SPEC;
+    return levels.count;
+}
+
+static void register_tag(log_tag_t *tag) {
+    const syssts_t status = chSysGetStatusAndLockX();
+
+    // another core may have registered it in the meantime
+    if (tag->registered) {
+        goto exit;
     }
 
-    (*str)++;
-    switch (**str) {
-        case 'L':
-            (*str)++;
-            switch (**str) {
-                case 'L': // %LL
-                    return LL_SPEC;
+    if (tags.count >= LOGGING_TAGS_SIZE) {
+        goto exit;
+    }
 
-                case 'S': // %LS
-                    return LS_SPEC;
+    tags.ptr[tags.count++] = tag;
+    tag->registered        = true;
 
-                default:
-                    return INVALID_SPEC;
-            }
+    // its level was set before it got used
+    const size_t index = find_level(tag->name);
+    if (index != levels.count) {
+        tag->level     = levels.ptr[index].level;
+        tag->has_level = true;
+    }
 
-        case 'M': // %M
-            return M_SPEC;
+exit:
+    chSysRestoreStatusX(status);
+}
+
+int set_logging_tag_level(const char *name, log_level_t new_level) {
+    if (new_level < LOG_DEBUG || new_level > LOG_NONE) {
+        return -EINVAL;
+    }
+
+    if (strlen(name) >= LOGGING_TAG_NAME_SIZE) {
+        return -EINVAL;
+    }
+
+    int exitcode = -ENOMEM;
 
-        case 'T': // %T
-            return T_SPEC;
+    const syssts_t status = chSysGetStatusAndLockX();
 
-        case '%': // %%
-            return PERC_SPEC;
+    for (size_t i = 0; i < tags.count; ++i) {
+        if (strcmp(tags.ptr[i]->name, name) == 0) {
+            tags.ptr[i]->level     = new_level;
+            tags.ptr[i]->has_level = true;
+            exitcode               = 0;
+        }
+    }
 
-        default:
-            return INVALID_SPEC;
+    // remember it for tags not registered yet
+    const size_t index = find_level(name);
+    if (index != levels.count) {
+        levels.ptr[index].level = new_level;
+        exitcode                = 0;
+    } else if (levels.count < LOGGING_TAGS_SIZE) {
+        strlcpy(levels.ptr[index].name, name, LOGGING_TAG_NAME_SIZE);
+        levels.ptr[index].level = new_level;
+        levels.count++;
+        exitcode = 0;
     }
 
-    __unreachable();
+    chSysRestoreStatusX(status);
+
+    return exitcode;
 }
 
+int reset_logging_tag_level(const char *name) {
+    int exitcode = -ENOENT;
+
+    const syssts_t status = chSysGetStatusAndLockX();
+
+    for (size_t i = 0; i < tags.count; ++i) {
+        if (strcmp(tags.ptr[i]->name, name) == 0) {
+            tags.ptr[i]->has_level = false;
+            exitcode               = 0;
+        }
+    }
+
+    // forget it, moving the last one into its place
+    const size_t index = find_level(name);
+    if (index != levels.count) {
+        levels.ptr[index] = levels.ptr[--levels.count];
+        exitcode          = 0;
+    }
+
+    chSysRestoreStatusX(status);
+
+    return exitcode;
+}
+
+// whether a message has to be emitted
+static bool should_log(log_tag_t *tag, log_level_t msg_level) {
+    if (tag == NULL) {
+        return msg_level >= level.filter;
+    }
+
+    if (!tag->registered) {
+        register_tag(tag);
+    }
+
+    if (tag->has_level) {
+        return msg_level >= tag->level;
+    }
+
+    return msg_level >= level.filter;
+}
+
+// internals
+static const log_segment_t segments[] = {LOGGING_FORMAT};
+STATIC_ASSERT(ARRAY_SIZE(segments) > 0, "Empty logging format");
+
 log_level_t get_current_message_level(void) {
     return level.message;
 }
 
-__weak_symbol const char *log_time(void) {
-    static char buff[10] = {0};
-    snprintf(buff, sizeof(buff), "%ld", timer_read32() / 1000);
-    return buff;
+__weak_symbol uint32_t log_timestamp(void) {
+#if defined(MCU_RP)
+    // free-running 1MHz counter, reading the raw value does not latch the high word
+    return TIMER->TIMERAWL;
+#else
+    return TIME_I2US(chVTGetSystemTimeX());
+#endif
 }
 
-static bool wrap_printf = true;
+// "seconds.microseconds" is at most 11 chars (4294.967295)
+#define TIME_STR_SIZE (12)
 
-static MUTEX_DECL(logging_mutex);
+// write `us` as "seconds.microseconds" at the end of `buff`, returns where it starts
+static const char *format_us(uint32_t us, char buff[TIME_STR_SIZE]) {
+    char *ptr = &buff[TIME_STR_SIZE - 1];
+    *ptr      = '\0';
 
-int logging(log_level_t msg_level, const char *msg, ...) {
-    int exitcode = 0;
+    uint32_t micros  = us % 1000000;
+    uint32_t seconds = us / 1000000;
 
-    bool has_acquired_lock = false;
+    for (size_t i = 0; i < 6; ++i) {
+        *--ptr = '0' + (micros % 10);
+        micros /= 10;
+    }
 
-    // message filtered out, quit
-    if (msg_level < level.filter) {
-        goto exit;
+    *--ptr = '.';
+
+    do {
+        *--ptr = '0' + (seconds % 10);
+        seconds /= 10;
+    } while (seconds > 0);
+
+    return ptr;
+}
+
+__weak_symbol const char *log_time(uint32_t timestamp) {
+    static char buff[TIME_STR_SIZE] = {0};
+    return format_us(timestamp, buff);
+}
+
+//
+// Queue
+//
+
+// multiple producers (both cores, ISRs) and a single consumer (housekeeping)
+//
+// producers only hold the lock while reserving a slot (bumping `head`), the message is written
+// afterwards and flagged as `ready` once complete, sinks stop at the first slot not ready yet
+//
+// each sink has its own position, slots are released once every sink is past them
+static struct {
+    log_record_t records[LOGGING_QUEUE_SIZE];
+    bool         ready[LOGGING_QUEUE_SIZE];
+    uint32_t     head;
+    uint32_t     tail;
+    uint32_t     previous;
+    uint32_t     dropped;
+    uint32_t     reported;
+} queue = {0};
+
+uint32_t get_dropped_logs(void) {
+    return queue.dropped;
+}
+
+// reserve a slot, NULL if queue is full
+//
+// timestamp is taken while holding the lock, thus it never goes backwards along the queue
+static log_record_t *queue_reserve(void) {
+    log_record_t *record = NULL;
+
+    // Cortex-M0+ has no compare-and-swap, a (very) short critical section does the job
+    // it works from any context, and on dual-core RP2040 it also takes the spinlock shared between cores
+    const syssts_t status = chSysGetStatusAndLockX();
+
+    const uint32_t tail = __atomic_load_n(&queue.tail, __ATOMIC_ACQUIRE);
+    if (queue.head - tail >= LOGGING_QUEUE_SIZE) {
+        queue.dropped++;
+    } else {
+        record = &queue.records[queue.head % LOGGING_QUEUE_SIZE];
+        queue.head++;
+
+        record->timestamp = log_timestamp();
+#if !defined(LOGGING_DEFERRED)
+        record->delta = record->timestamp - queue.previous;
+#endif
+        queue.previous = record->timestamp;
     }
 
-    va_list args;
-    if (!wrap_printf) {
-        va_start(args, msg);
-        vprintf(msg, args);
-        va_end(args);
-        print("\n");
+    chSysRestoreStatusX(status);
+
+    return record;
+}
+
+static struct {
+    log_sink_t *ptr[LOGGING_SINKS_SIZE];
+    size_t      count;
+} sinks = {
+    .ptr   = {&console_log_sink},
+    .count = 1,
+};
+
+static void queue_commit(log_record_t *record) {
+    // written right away, would be lost if a crash happened before housekeeping
+    const syssts_t status = chSysGetStatusAndLockX();
+
+    for (size_t i = 0; i < sinks.count; ++i) {
+        log_sink_t *const sink = sinks.ptr[i];
+        if (sink->immediate) {
+            sink->write(sink, record);
+        }
+    }
+
+    chSysRestoreStatusX(status);
+
+    const size_t slot = record - queue.records;
+    __atomic_store_n(&queue.ready[slot], true, __ATOMIC_RELEASE);
+}
+
+// record at position `index`, if it has been completely written already
+static const log_record_t *queue_peek(uint32_t index) {
+    // slots are only released after every sink is done, a sink past the newest record would wrap into old ones
+    if (index - __atomic_load_n(&queue.tail, __ATOMIC_ACQUIRE) >= LOGGING_QUEUE_SIZE) {
+        return NULL;
+    }
+
+    const size_t slot = index % LOGGING_QUEUE_SIZE;
+
+    if (!__atomic_load_n(&queue.ready[slot], __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    return &queue.records[slot];
+}
+
+static void queue_pop(void) {
+    const size_t slot = queue.tail % LOGGING_QUEUE_SIZE;
+
+    queue.ready[slot] = false;
+    __atomic_store_n(&queue.tail, queue.tail + 1, __ATOMIC_RELEASE);
+}
+
+//
+// Flood protection
+//
+
+static const char repeated_msg[] = "last message repeated %ld times";
+static const char dropped_msg[]  = "dropped %ld messages";
+static const char limited_msg[]  = "rate-limited %ld messages";
+
+typedef struct {
+    const char *msg;
+    uint32_t    refill;
+    uint8_t     tokens;
+} rate_slot_t;
+
+// direct-mapped table, a call site taking the slot of another one starts over with a full bucket
+static struct {
+    rate_slot_t slots[LOGGING_RATE_LIMIT_SLOTS];
+    uint32_t    suppressed;
+    uint32_t    reported;
+} rate = {0};
+
+// previous message, to coalesce repetitions
+static struct {
+    const char *msg;
+    uint32_t    hash;
+    log_level_t level;
+    uint32_t    repeated;
+    uint32_t    time;
+} last = {
+    .level = LOG_NONE,
+};
+
+uint32_t get_rate_limited_logs(void) {
+    return rate.suppressed;
+}
+
+// FNV-1a
+static uint32_t hash_message(const void *data, size_t size) {
+    const uint8_t *bytes = data;
+
+    uint32_t hash = 2166136261;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 16777619;
+    }
+
+    return hash;
+}
+
+// bucket of a call site, with its tokens refilled. must be called with the lock held
+static rate_slot_t *get_slot(const char *msg, uint32_t now) {
+    rate_slot_t *const slot = &rate.slots[((uintptr_t)msg >> 2) % LOGGING_RATE_LIMIT_SLOTS];
+
+    if (slot->msg != msg) {
+        slot->msg    = msg;
+        slot->refill = now;
+        slot->tokens = LOGGING_RATE_LIMIT_BURST;
+    }
+
+    const uint32_t refills = (now - slot->refill) / (LOGGING_RATE_LIMIT_PERIOD * 1000);
+    if (refills > 0) {
+        slot->tokens = MIN(LOGGING_RATE_LIMIT_BURST, slot->tokens + refills);
+        slot->refill += refills * (LOGGING_RATE_LIMIT_PERIOD * 1000);
+    }
+
+    return slot;
+}
+
+// whether call site has budget left, must be called with the lock held
+static bool take_token(const char *msg, uint32_t now) {
+    rate_slot_t *const slot = get_slot(msg, now);
+
+    if (slot->tokens == 0) {
+        return false;
+    }
+
+    slot->tokens--;
+    return true;
+}
+
+// queue a message generated by the module itself, with a single argument
+// returns whether there was room for it
+static bool queue_notice(log_level_t msg_level, const char *msg, uint32_t value) {
+    log_record_t *const record = queue_reserve();
+    if (record == NULL) {
+        return false;
+    }
+
+    record->msg   = msg;
+    record->level = msg_level;
+
+#if defined(LOGGING_DEFERRED)
+    record->n_args  = 1;
+    record->args[0] = value;
+#else
+    snprintf(record->text, sizeof(record->text), msg, value);
+#endif
+
+    queue_commit(record);
+
+    return true;
+}
+
+// whether a message has to be queued, `hash` identifies its contents
+static bool check_flood(log_level_t msg_level, const char *msg, uint32_t hash, uint32_t now) {
+    bool        emit     = false;
+    uint32_t    repeated = 0;
+    log_level_t previous = last.level;
+
+    const syssts_t status = chSysGetStatusAndLockX();
+
+    if (msg == last.msg && hash == last.hash && msg_level == last.level) {
+        last.repeated++;
         goto exit;
     }
 
-    // (try) lock before running actual logic
-    if (!chMtxTryLock(&logging_mutex)) {
-        exitcode = -EBUSY;
+    if (!take_token(msg, now)) {
+        rate.suppressed++;
         goto exit;
     }
-    has_acquired_lock = true;
 
-    // set msg lvel
-    level.message = msg_level;
+    emit     = true;
+    repeated = last.repeated;
+    previous = last.level;
+
+    last.msg      = msg;
+    last.hash     = hash;
+    last.level    = msg_level;
+    last.repeated = 0;
+    last.time     = now;
+
+exit:
+    chSysRestoreStatusX(status);
+
+    // previous message is done repeating, report it before the new one
+    if (repeated > 0) {
+        queue_notice(previous, repeated_msg, repeated);
+    }
+
+    return emit;
+}
+
+#if !defined(LOGGING_DEFERRED)
+// whether call site is out of budget, checked before formatting the message so that floods are cheap
+// its messages are dropped (as rate-limited) even if they repeat the last one, that needs the formatted text
+static bool is_rate_limited(const char *msg, uint32_t now) {
+    const syssts_t status = chSysGetStatusAndLockX();
+
+    const bool limited = get_slot(msg, now)->tokens == 0;
+    if (limited) {
+        rate.suppressed++;
+    }
+
+    chSysRestoreStatusX(status);
+
+    return limited;
+}
+#endif
+
+// report repetitions of a message that is still going on
+static void flush_repeated(void) {
+    const uint32_t now = log_timestamp();
+
+    uint32_t    repeated = 0;
+    log_level_t previous = LOG_NONE;
+
+    const syssts_t status = chSysGetStatusAndLockX();
+
+    if (last.repeated > 0 && now - last.time >= LOGGING_REPEATED_INTERVAL * 1000) {
+        repeated      = last.repeated;
+        previous      = last.level;
+        last.repeated = 0;
+        last.time     = now;
+    }
+
+    chSysRestoreStatusX(status);
+
+    if (repeated > 0) {
+        queue_notice(previous, repeated_msg, repeated);
+    }
+}
+
+//
+// Producers
+//
+
+#if defined(LOGGING_DEFERRED)
+int log_deferred(log_tag_t *tag, log_level_t msg_level, const char *msg, size_t n_args, const uint32_t *args) {
+    // message filtered out, quit
+    if (!should_log(tag, msg_level)) {
+        return 0;
+    }
+
+    const uint32_t now = log_timestamp();
+
+    // repeated or flooding, quit
+    if (!check_flood(msg_level, msg, hash_message(args, n_args * sizeof(uint32_t)), now)) {
+        return 0;
+    }
+
+    log_record_t *const record = queue_reserve();
+    if (record == NULL) {
+        return -ENOBUFS;
+    }
+
+    record->msg    = msg;
+    record->level  = msg_level;
+    record->n_args = n_args;
+    memcpy(record->args, args, n_args * sizeof(uint32_t));
+
+    queue_commit(record);
+
+    return 0;
+}
+#endif
+
+static int vlogging(log_tag_t *tag, log_level_t msg_level, const char *msg, va_list args) {
+    // message filtered out, quit
+    if (!should_log(tag, msg_level)) {
+        return 0;
+    }
+
+    const uint32_t now = log_timestamp();
+
+#if defined(LOGGING_DEFERRED)
+    // can't know the arguments' types here, keep the format only
+    const uint32_t hash = hash_message(NULL, 0);
+#else
+    // flooding, quit
+    if (is_rate_limited(msg, now)) {
+        return 0;
+    }
+
+    // formatted beforehand, to detect repetitions without taking a slot
+    char text[LOGGING_MESSAGE_SIZE];
+    vsnprintf(text, sizeof(text), msg, args);
+
+    const uint32_t hash = hash_message(text, strlen(text));
+#endif
+
+    // repeated or flooding, quit
+    if (!check_flood(msg_level, msg, hash, now)) {
+        return 0;
+    }
+
+    log_record_t *const record = queue_reserve();
+    if (record == NULL) {
+        return -ENOBUFS;
+    }
+
+    record->msg   = msg;
+    record->level = msg_level;
 
-    const char *format = LOGGING_FORMAT;
-    while (true) {
-        // order specs alphabetically, special cases first
-        switch (get_token(&format)) {
-            case INVALID_SPEC: // reached when the logging format is invalid
-                wrap_printf = false;
-                exitcode    = -EINVAL;
-                goto exit;
+#if defined(LOGGING_DEFERRED)
+    record->n_args = 0;
+#else
+    memcpy(record->text, text, sizeof(record->text));
+#endif
 
-            case STR_END:
-                level.message = LOG_NONE;
-                print("\n");
-                goto exit;
+    queue_commit(record);
 
-            case NO_SPEC: // print any char
-                printf("%c", *format);
+    return 0;
+}
+
+// parenthesis prevent the expansion of `logging` when it is a macro (deferred mode)
+int(logging)(log_level_t msg_level, const char *msg, ...) {
+    va_list args;
+    va_start(args, msg);
+    const int exitcode = vlogging(NULL, msg_level, msg, args);
+    va_end(args);
+
+    return exitcode;
+}
+
+int log_tagged(log_tag_t *tag, log_level_t msg_level, const char *msg, ...) {
+    va_list args;
+    va_start(args, msg);
+    const int exitcode = vlogging(tag, msg_level, msg, args);
+    va_end(args);
+
+    return exitcode;
+}
+
+//
+// Consumer
+//
+
+#if !defined(LOGGING_DEFERRED)
+// append `str` to `buffer`, truncating if needed
+static size_t append(char *buffer, size_t size, size_t len, const char *str) {
+    while (*str != '\0' && len + 1 < size) {
+        buffer[len++] = *str++;
+    }
+
+    buffer[len] = '\0';
+    return len;
+}
+#endif
+
+size_t log_format_record(const log_record_t *record, char *buffer, size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+
+#if defined(LOGGING_DEFERRED)
+    size_t len = snprintf(buffer, size, "[LOG] %lx %x %lx", (uint32_t)(uintptr_t)record->msg, record->level, record->timestamp);
+    for (size_t arg = 0; arg < record->n_args && len < size; ++arg) {
+        len += snprintf(buffer + len, size - len, " %lx", record->args[arg]);
+    }
+
+    return MIN(len, size - 1);
+#else
+    size_t len = 0;
+
+    for (size_t i = 0; i < ARRAY_SIZE(segments); ++i) {
+        switch (segments[i].type) {
+            case LOG_SEGMENT_TEXT: // copy a whole literal run
+                len = append(buffer, size, len, segments[i].text);
                 break;
 
-            case LL_SPEC: // print log level (long)
-                printf("%s", level_str[msg_level]);
+            case LOG_SEGMENT_LEVEL_LONG: // log level (long)
+                len = append(buffer, size, len, level_str[record->level]);
                 break;
 
-            case LS_SPEC: // print log level (short)
-                printf("%c", level_str[msg_level][0]);
+            case LOG_SEGMENT_LEVEL_SHORT: // log level (short)
+                len = append(buffer, size, len, (const char[]){level_str[record->level][0], '\0'});
                 break;
 
-            case M_SPEC: // print actual message
-                va_start(args, msg);
-                vprintf(msg, args);
-                va_end(args);
+            case LOG_SEGMENT_MESSAGE: // actual message
+                len = append(buffer, size, len, record->text);
                 break;
 
-            case PERC_SPEC: // print a '%'
-                printf("%%");
+            case LOG_SEGMENT_TIME: // time of the message
+                len = append(buffer, size, len, log_time(record->timestamp));
                 break;
 
-            case T_SPEC: // print current time
-                printf("%s", log_time());
+            case LOG_SEGMENT_TIME_DELTA: { // time since previous message
+                char delta[TIME_STR_SIZE];
+                len = append(buffer, size, len, "+");
+                len = append(buffer, size, len, format_us(record->delta, delta));
                 break;
+            }
+        }
+    }
+
+    return len;
+#endif
+}
+
+static void console_write(__unused log_sink_t *sink, const log_record_t *record) {
+    char line[LOGGING_LINE_SIZE];
+    log_format_record(record, line, sizeof(line));
+
+    level.message = record->level;
+    printf("%s\n", line);
+    level.message = LOG_NONE;
+}
+
+log_sink_t console_log_sink = {
+    .name   = "console",
+    .write  = console_write,
+    .budget = 500,
+};
+
+int log_sink_register(log_sink_t *sink) {
+    if (sinks.count >= LOGGING_SINKS_SIZE) {
+        return -ENOMEM;
+    }
+
+    // only gets messages from now on
+    sink->tail = queue.tail;
+
+    sinks.ptr[sinks.count++] = sink;
+    return 0;
+}
+
+// send messages to a sink, until it runs out of them (or time)
+static void drain_sink(log_sink_t *sink) {
+    // system ticks are too coarse for budgets in microseconds
+    const uint32_t start = log_timestamp();
+
+    do {
+        const log_record_t *const record = queue_peek(sink->tail);
+        if (record == NULL) {
+            break;
+        }
+
+        sink->write(sink, record);
+        sink->tail++;
+    } while (log_timestamp() - start < sink->budget);
+}
+
+ASSERT_COMMUNITY_MODULES_MIN_API_VERSION(1, 0, 0);
+
+void keyboard_pre_init_logging(void) {
+    ram_log_recover();
+
+    keyboard_pre_init_logging_kb();
+}
+
+void housekeeping_task_logging(void) {
+    // reported through the sinks, like any other message. if there is no room for the report, it is tried again
+    // next time (counting itself as dropped)
+    const uint32_t dropped = queue.dropped;
+    if (dropped != queue.reported && queue_notice(LOG_WARN, dropped_msg, dropped - queue.reported)) {
+        queue.reported = dropped;
+    }
+
+    const uint32_t suppressed = rate.suppressed;
+    if (suppressed != rate.reported && queue_notice(LOG_WARN, limited_msg, suppressed - rate.reported)) {
+        rate.reported = suppressed;
+    }
+
+    flush_repeated();
+
+    // messages can be released once all sinks are done with them
+    uint32_t pending = LOGGING_QUEUE_SIZE;
+
+    for (size_t i = 0; i < sinks.count; ++i) {
+        log_sink_t *const sink = sinks.ptr[i];
+
+        // already got its messages
+        if (sink->immediate) {
+            continue;
         }
 
-        format++;
+        drain_sink(sink);
+        pending = MIN(pending, sink->tail - queue.tail);
     }
 
-exit:
-    if (has_acquired_lock) {
-        chMtxUnlock(&logging_mutex);
+    for (uint32_t i = 0; i < pending; ++i) {
+        queue_pop();
     }
 
-    return exitcode;
+    housekeeping_task_logging_kb();
 }
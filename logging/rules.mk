@@ -0,0 +1 @@
+SRC += $(MODULE_PATH_LOGGING)/sinks.c
@@ -0,0 +1,313 @@
+// Copyright Pablo Martinez (@elpekenin) <elpekenin@elpekenin.dev>
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <string.h>
+
+#include "elpekenin/logging.h"
+#include "quantum.h"
+
+//
+// RAM
+//
+
+// if crash module is enabled, buffer lives in a section that is not cleared on (re)boot
+// thus messages survive a crash, and can be dumped afterwards
+#if defined(COMMUNITY_MODULE_CRASH_ENABLE)
+#    ifndef __noinit
+#        define __noinit __attribute__((section(".no_init")))
+#    endif
+#    define RAM_SECTION __noinit
+#else
+#    define RAM_SECTION
+#endif
+
+// flags that the buffer has been initialized
+#define RAM_MAGIC (0x1066AB1E)
+
+// each message is stored as a header, followed by `size` bytes of payload:
+//   - formatted message, without null terminator
+//   - deferred mode: address of the format string, followed by the arguments
+typedef struct PACKED {
+    uint8_t  size;
+    uint8_t  level;
+    uint8_t  boot;
+    uint8_t  checksum;
+    uint32_t timestamp;
+} ram_entry_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t head;
+    uint32_t used;
+    uint32_t boot;
+    uint32_t checksum;
+    uint8_t  buffer[LOGGING_RAM_SIZE];
+} ram_t;
+
+RAM_SECTION static ram_t ram;
+
+static bool recovered = false;
+
+static void ram_copy_in(size_t offset, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; ++i) {
+        ram.buffer[(offset + i) % LOGGING_RAM_SIZE] = bytes[i];
+    }
+}
+
+static void ram_copy_out(size_t offset, void *data, size_t size) {
+    uint8_t *bytes = data;
+    for (size_t i = 0; i < size; ++i) {
+        bytes[i] = ram.buffer[(offset + i) % LOGGING_RAM_SIZE];
+    }
+}
+
+// offset of the oldest entry
+static inline size_t ram_tail(void) {
+    return (ram.head + LOGGING_RAM_SIZE - ram.used) % LOGGING_RAM_SIZE;
+}
+
+static uint32_t ram_checksum(void) {
+    return ~(ram.magic + 31 * ram.head + 17 * ram.used + 7 * ram.boot);
+}
+
+// checksum of an entry: its header (with checksum set to 0) and payload
+static uint8_t entry_checksum(size_t offset, const ram_entry_t *entry) {
+    ram_entry_t header = *entry;
+    header.checksum    = 0;
+
+    uint8_t checksum = 0;
+
+    const uint8_t *bytes = (const uint8_t *)&header;
+    for (size_t i = 0; i < sizeof(header); ++i) {
+        checksum = (checksum << 1 | checksum >> 7) ^ bytes[i];
+    }
+
+    for (size_t i = 0; i < entry->size; ++i) {
+        checksum = (checksum << 1 | checksum >> 7) ^ ram.buffer[(offset + sizeof(header) + i) % LOGGING_RAM_SIZE];
+    }
+
+    return checksum;
+}
+
+static void ram_reset(void) {
+    ram.magic = RAM_MAGIC;
+    ram.head  = 0;
+    ram.used  = 0;
+    ram.boot  = 0;
+}
+
+void ram_log_recover(void) {
+    if (ram.magic != RAM_MAGIC || ram.checksum != ram_checksum() || ram.head >= LOGGING_RAM_SIZE || ram.used > LOGGING_RAM_SIZE) {
+        ram_reset();
+        goto exit;
+    }
+
+    // keep the (oldest) entries that are intact
+    size_t offset = ram_tail();
+    size_t valid  = 0;
+
+    while (valid < ram.used) {
+        ram_entry_t entry;
+        ram_copy_out(offset, &entry, sizeof(entry));
+
+        const size_t total = sizeof(entry) + entry.size;
+        if (valid + total > ram.used || entry.checksum != entry_checksum(offset, &entry)) {
+            break;
+        }
+
+        offset = (offset + total) % LOGGING_RAM_SIZE;
+        valid += total;
+    }
+
+    ram.head  = offset;
+    ram.used  = valid;
+    recovered = valid != 0;
+
+exit:
+    ram.boot++;
+    ram.checksum = ram_checksum();
+}
+
+bool ram_logs_recovered(void) {
+    return recovered;
+}
+
+static void ram_write(__unused log_sink_t *sink, const log_record_t *record) {
+#if defined(LOGGING_DEFERRED)
+    const void  *payload = &record->msg;
+    const size_t size    = sizeof(record->msg);
+    const size_t n_args  = record->n_args * sizeof(uint32_t);
+#else
+    const void  *payload = record->text;
+    const size_t size    = MIN(strnlen(record->text, sizeof(record->text)), UINT8_MAX);
+    const size_t n_args  = 0;
+#endif
+
+    ram_entry_t entry = {
+        .size      = size + n_args,
+        .level     = record->level,
+        .boot      = ram.boot,
+        .timestamp = record->timestamp,
+    };
+
+    const size_t total = sizeof(entry) + entry.size;
+    if (total > LOGGING_RAM_SIZE) {
+        return;
+    }
+
+    // make room, dropping the oldest entries
+    size_t used = ram.used;
+    while (LOGGING_RAM_SIZE - used < total) {
+        ram_entry_t oldest;
+        ram_copy_out((ram.head + LOGGING_RAM_SIZE - used) % LOGGING_RAM_SIZE, &oldest, sizeof(oldest));
+        used -= sizeof(oldest) + oldest.size;
+    }
+
+    // metadata is updated before and after writing, so that a crash at any point leaves the buffer in a valid state
+    ram.used     = used;
+    ram.checksum = ram_checksum();
+
+    ram_copy_in(ram.head + sizeof(entry), payload, size);
+#if defined(LOGGING_DEFERRED)
+    ram_copy_in(ram.head + sizeof(entry) + size, record->args, n_args);
+#endif
+
+    entry.checksum = entry_checksum(ram.head, &entry);
+    ram_copy_in(ram.head, &entry, sizeof(entry));
+
+    ram.head     = (ram.head + total) % LOGGING_RAM_SIZE;
+    ram.used     = used + total;
+    ram.checksum = ram_checksum();
+}
+
+log_sink_t ram_log_sink = {
+    .name      = "ram",
+    .write     = ram_write,
+    .immediate = true,
+};
+
+void print_ram_logs(void) {
+    size_t offset = ram_tail();
+    size_t left   = ram.used;
+
+    // no entry has this one (yet), first one gets a separator too
+    uint8_t boot = ram.boot + 1;
+
+#if !defined(LOGGING_DEFERRED)
+    uint32_t previous = 0;
+#endif
+
+    while (left > 0) {
+        ram_entry_t entry;
+        ram_copy_out(offset, &entry, sizeof(entry));
+
+        // separate the messages of each execution, if any older one was recovered
+        if (recovered && entry.boot != boot) {
+            boot = entry.boot;
+            printf("-- boot %d --\n", boot);
+        }
+
+        log_record_t record = {
+            .timestamp = entry.timestamp,
+            .level     = entry.level,
+        };
+
+#if defined(LOGGING_DEFERRED)
+        ram_copy_out(offset + sizeof(entry), &record.msg, sizeof(record.msg));
+
+        record.n_args = (entry.size - sizeof(record.msg)) / sizeof(uint32_t);
+        ram_copy_out(offset + sizeof(entry) + sizeof(record.msg), record.args, record.n_args * sizeof(uint32_t));
+#else
+        // entries are consecutive messages, thus delta can be rebuilt
+        // (two producers may commit out of order, don't go negative)
+        record.delta = entry.timestamp >= previous ? entry.timestamp - previous : 0;
+        ram_copy_out(offset + sizeof(entry), record.text, MIN(entry.size, sizeof(record.text) - 1));
+
+        previous = entry.timestamp;
+#endif
+
+        char line[LOGGING_LINE_SIZE];
+        log_format_record(&record, line, sizeof(line));
+        printf("%s\n", line);
+
+        offset = (offset + sizeof(entry) + entry.size) % LOGGING_RAM_SIZE;
+        left -= sizeof(entry) + entry.size;
+    }
+}
+
+//
+// Scrollback (UI)
+//
+
+#if defined(COMMUNITY_MODULE_UI_ENABLE)
+#    include "elpekenin/ui/utils.h"
+
+static struct {
+    char     lines[LOGGING_SCROLLBACK_LINES][LOGGING_SCROLLBACK_LINE_SIZE];
+    uint32_t count;
+} scrollback = {0};
+
+static void scrollback_write(__unused log_sink_t *sink, const log_record_t *record) {
+    char *const line = scrollback.lines[scrollback.count % LOGGING_SCROLLBACK_LINES];
+    log_format_record(record, line, LOGGING_SCROLLBACK_LINE_SIZE);
+
+    scrollback.count++;
+}
+
+log_sink_t scrollback_log_sink = {
+    .name   = "scrollback",
+    .write  = scrollback_write,
+    .budget = 200,
+};
+
+bool log_terminal_init(ui_node_t *self) {
+    log_terminal_args_t *const args = self->args;
+    args->last                      = ~0;
+    return ui_font_fits(self);
+}
+
+ui_time_t log_terminal_render(const ui_node_t *self, painter_device_t display) {
+    log_terminal_args_t *const args = self->args;
+
+    const uint32_t count = scrollback.count;
+    if (args->last == count) {
+        goto exit;
+    }
+
+    const painter_font_handle_t font = qp_load_font_mem(args->font);
+    if (font == NULL) {
+        goto exit;
+    }
+
+    // coordinates are inclusive
+    qp_rect(display, self->start.x, self->start.y, self->start.x + self->size.x - 1, self->start.y + self->size.y - 1, HSV_BLACK, true);
+
+    // newest lines that fit, oldest on top
+    const size_t n_lines = MIN(MIN(self->size.y / font->line_height, LOGGING_SCROLLBACK_LINES), count);
+
+    for (size_t i = 0; i < n_lines; ++i) {
+        char line[LOGGING_SCROLLBACK_LINE_SIZE];
+        strlcpy(line, scrollback.lines[(count - n_lines + i) % LOGGING_SCROLLBACK_LINES], sizeof(line));
+
+        // cut until it fits
+        size_t len = strlen(line);
+        while (len > 0 && !ui_text_fits(self, font, line)) {
+            line[--len] = '\0';
+        }
+
+        if (len == 0) {
+            continue;
+        }
+
+        qp_drawtext(display, self->start.x, self->start.y + i * font->line_height, font, line);
+    }
+
+    args->last = count;
+
+    qp_close_font(font);
+
+exit:
+    return args->interval;
+}
+#endif
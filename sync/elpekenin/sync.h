@@ -4,11 +4,14 @@
 /**
  * Synchronize variables over split comms.
  *
- * Values are synchronized by writing to their memory addresses. As such, the variables need to be on the same address on both sides.
+ * Values are identified by a small ID, rather than their memory address. Each side registers where the variable with
+ * a given ID lives on it, thus they don't need to be on the same address on both sides.
+ *
+ * By default, values go from master to slave. Auto-synced variables can also be written by slave (or both sides).
  *   - ☑ Global variables
  *   - ☐ Local variables (stack memory)
  *   - ☑ Local variables in a function marked as ``static``
- *   - ☐ Dynamically-allocated variables (heap)
+ *   - ☑ Dynamically-allocated variables (heap), see :c:func:`sync_register`
  *
  * NOTE: Community modules don't yet support custom IDs, you must add ``ELPEKENIN_SYNC_ID`` to your ``SPLIT_TRANSACTION_IDS_USER`` in ``config.h``
  */
@@ -21,7 +24,10 @@
 #    error "Sync doesn't make sense on non-split keyboards"
 #endif
 
+#include <errno.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "compiler_support.h"
 #include "transactions.h"
@@ -32,39 +38,164 @@ typedef struct PACKED {
     size_t size;
 } memory_slice_t;
 
-#define SYNC_MAX_PAYLOAD_SIZE (RPC_M2S_BUFFER_SIZE - sizeof(memory_slice_t))
+// Not intended to be used by users -> no docstring
+typedef enum {
+    SYNC_OP_FULL,
+    SYNC_OP_DELTA,
+    SYNC_OP_CHUNK,
+    SYNC_OP_COMMIT,
+    SYNC_OP_LOST,
+} sync_op_t;
 
 typedef struct PACKED {
-    memory_slice_t slice;
-    uint8_t        value[SYNC_MAX_PAYLOAD_SIZE];
-} memory_view_t;
+    uint8_t op;
+    uint8_t version;
+    uint8_t id;
+    uint8_t size;
+} sync_header_t;
+
+// IDs with this bit set refer to auto-sync entries (by their index), instead of the registry
+#define SYNC_CONFIG_ID_FLAG (1 << 7)
+
+#define SYNC_MAX_PAYLOAD_SIZE (RPC_M2S_BUFFER_SIZE - sizeof(sync_header_t))
+
+// a range of changed bytes, followed by their new value
+typedef struct PACKED {
+    uint8_t offset;
+    uint8_t size;
+} sync_run_t;
+
+// position of a piece of a large variable, followed by its bytes
+typedef struct PACKED {
+    uint16_t offset;
+} sync_chunk_t;
+
+// How many IDs can be registered (at most 128).
+#ifndef SYNC_REGISTRY_SIZE
+#    define SYNC_REGISTRY_SIZE (16)
+#endif
+
+/**
+ * Tell where the variable with ``id`` lives on this side, must be done on both of them.
+ *
+ * Only the ID is sent over the wire, so the address can be different on each side (eg: a buffer allocated at runtime).
+ * Registering an ID again replaces its address, eg: after reallocating the buffer.
+ *
+ * .. code-block:: c
+ *
+ *     uint8_t *buffer;
+ *
+ *     void keyboard_post_init_user(void) {
+ *         buffer = malloc(20);
+ *         sync_register(0, buffer, 20);
+ *     }
+ *
+ * Return: Error code.
+ *    * ``0``: Variable registered.
+ *    * ``-EINVAL``: Invalid ID, or ``NULL`` address.
+ */
+int sync_register(uint8_t id, void *addr, size_t size);
+
+/**
+ * Stop syncing the variable with ``id``, messages for it are ignored from now on.
+ *
+ * Return: Error code.
+ *    * ``0``: Variable unregistered.
+ *    * ``-EINVAL``: Invalid ID.
+ */
+int sync_unregister(uint8_t id);
+
+/**
+ * Register ``variable`` under ``id``.
+ */
+#define SYNC_REGISTER(id, variable) sync_register(id, &(variable), sizeof(variable))
 
-void sync_variable(void *addr, size_t size);
+/**
+ * Sync the value at ``addr`` to slave side.
+ *
+ * Return: Error code.
+ *    * ``0``: Value sent (or queued, if a batch is open).
+ *    * ``-ENOENT``: ``addr`` has not been registered.
+ *    * ``-E2BIG``: Value is bigger than ``SYNC_MAX_PAYLOAD_SIZE``.
+ *    * ``-ENOSPC``: No room for it (slave's messages wait until master asks for them).
+ */
+int sync_variable(void *addr, size_t size);
+
+/**
+ * Sync the value at ``addr`` to slave side, sending only the bytes that differ from ``shadow``.
+ *
+ * ``shadow`` must hold the last value sent, it gets updated by this function.
+ *
+ * Changed bytes are sent as ``(offset, size, bytes)`` runs, which the slave patches in place.
+ * If that would not be smaller than the whole value, it is sent as-is instead.
+ *
+ * .. hint::
+ *   Used by auto-sync for variables synced upon change, large structs where a single field changes
+ *   at a time take a fraction of the bandwidth.
+ *
+ * Return: Error code, same as :c:func:`sync_variable`.
+ */
+int sync_variable_delta(void *addr, void *shadow, size_t size);
 
 /**
- * Sync the value of ``variable`` to slave side.
+ * Start packing messages together, instead of sending each of them right away.
+ *
+ * While a batch is open, messages are appended to a buffer which is only sent once the next message would not fit
+ * in it (``RPC_M2S_BUFFER_SIZE``), or upon :c:func:`sync_batch_end`. The slave handles them in order.
+ *
+ * .. hint::
+ *   Auto-sync does this on every housekeeping, to pay a single round trip when several variables change together.
+ *
+ * .. code-block:: c
+ *
+ *     sync_batch_begin();
+ *     SYNC_VARIABLE(foo);
+ *     SYNC_VARIABLE(bar);
+ *     sync_batch_end(); // both sent in a single transaction (if they fit)
+ */
+void sync_batch_begin(void);
+
+/**
+ * Send the messages pending on current batch, and go back to sending each of them right away.
+ */
+void sync_batch_end(void);
+
+/**
+ * Sync the value of ``variable`` to slave side. It must have been registered on both sides.
+ *
+ * .. warning::
+ *   Variables are looked up by their address, one that was never registered is not sent at all. Check the result
+ *   (same as :c:func:`sync_variable`) to find out.
  *
  * .. code-block:: c
  *
  *     #include "elpekenin/sync.h"
  *
+ *     enum { MY_VARIABLE_ID };
+ *
  *     uint8_t my_variable = 0;
  *
+ *     void keyboard_post_init_user(void) {
+ *         SYNC_REGISTER(MY_VARIABLE_ID, my_variable);
+ *     }
+ *
  *     bool process_record_user(uint16_t keycode, keyrecord_t *record) {
  *         if (keycode == MY_KEYCODE && record->event.pressed) {
  *             my_variable += 1;
- *             SYNC_VARIABLE(my_variable);
+ *             if (SYNC_VARIABLE(my_variable) < 0) {
+ *                 // not registered, or no room for it
+ *             }
  *             return false;
  *         }
  *
  *         return true;
  *     }
  */
-#define SYNC_VARIABLE(variable)                                                          \
-    do {                                                                                 \
-        STATIC_ASSERT(sizeof(variable) <= SYNC_MAX_PAYLOAD_SIZE, "Variable is too big"); \
-        sync_variable(&(variable), sizeof(variable));                                    \
-    } while (0)
+#define SYNC_VARIABLE(variable)                                                                                \
+    ({                                                                                                         \
+        STATIC_ASSERT(sizeof(variable) <= SYNC_MAX_PAYLOAD_SIZE, "Variable is too big, use auto-sync for it"); \
+        sync_variable(&(variable), sizeof(variable));                                                          \
+    })
 
 /**
  * You can also define a list of variables to be synched automatically by the module.
@@ -72,7 +203,17 @@ void sync_variable(void *addr, size_t size);
  * For this, you need to add ``#define AUTO_SYNC_ENABLE`` on ``config.h``
  *
  * .. warning::
- *    This setting will consume a significant amount of memory.
+ *    Variables synced upon change (and the ones bigger than ``SYNC_MAX_PAYLOAD_SIZE``) need a copy of their value,
+ *    to send only the bytes that changed. This will consume as much memory as the variables themselves.
+ *
+ * .. note::
+ *    Changes are detected by comparing a 32-bit hash (FNV-1a) of the value, rather than the value itself.
+ *    At most ``SYNC_HASH_BYTES_PER_TASK`` bytes of each variable are hashed on every housekeeping, changes on bigger
+ *    ones take a few of them to be noticed.
+ *
+ * .. note::
+ *    These don't need to be registered, their ID is their position in ``sync_configs``. Thus, both sides must have
+ *    the same list (up to 128 entries), but the variables can be on different addresses.
  *
  * .. code-block:: c
  *
@@ -86,39 +227,159 @@ void sync_variable(void *addr, size_t size);
  *         SYNC_TIMER(foo, 200),
  *         SYNC_CHANGE(bar),
  *     };
+ *
+ * .. hint::
+ *    Variables bigger than ``SYNC_MAX_PAYLOAD_SIZE`` (up to 65535 bytes) are also supported here. They are sent in chunks,
+ *    a few of them on each housekeeping, and the slave applies the new value at once, after receiving all of them.
  */
 
 // -- barrier --
 #ifdef AUTO_SYNC_ENABLE
+/**
+ * Which side(s) write a variable, and thus send its value to the other one.
+ */
+typedef enum {
+    /**
+     * Master writes, slave reads. Default.
+     */
+    SYNC_M2S = 1 << 0,
+    /**
+     * Slave writes, master reads. Eg: slave-side sensors or encoders.
+     *
+     * .. note::
+     *    Slave's values are sent on the responses to master's transactions, which polls every ``SYNC_POLL_INTERVAL``
+     *    milliseconds if it has nothing to send. Thus, they can't be bigger than ``RPC_S2M_BUFFER_SIZE``
+     *    (minus some bytes for the header).
+     */
+    SYNC_S2M = 1 << 1,
+    /**
+     * Both sides write.
+     *
+     * Every write increases a version counter, and the other side only applies newer values. If both sides write at
+     * the same time, master's value wins.
+     *
+     * .. note::
+     *    Whenever the link is (re)established, eg: on boot or after re-plugging a half, master sends these variables
+     *    again and both counters start over.
+     */
+    SYNC_BOTH = SYNC_M2S | SYNC_S2M,
+} sync_direction_t;
+
 typedef struct PACKED {
     memory_slice_t slice;
     uint32_t       rate;
+    uint8_t       *shadow;
+    uint8_t        direction;
+    uint8_t        priority;
 } sync_config_t;
 
 typedef struct PACKED {
     uint32_t last_update;
-    uint8_t  value[SYNC_MAX_PAYLOAD_SIZE];
+    uint32_t hash;
+    uint32_t next_hash;
+    uint16_t hashed;
+    uint32_t deadline;
+    uint16_t offset;
+    bool     sending;
+    bool     pending;
+    bool     tried;
+    bool     resend;
+    bool     resync;
+    uint8_t  version;
 } sync_state_t;
 
+/**
+ * Statistics about auto-sync.
+ */
+typedef struct {
+    /**
+     * Bytes sent by this side, over the last second.
+     */
+    uint32_t bytes_per_second;
+
+    /**
+     * How many times a pending value was left for the next housekeeping, due to the budget.
+     */
+    uint32_t deferred;
+
+    /**
+     * Longest time (in milliseconds) that a value has waited to be sent, since it changed (or its timer expired).
+     */
+    uint32_t worst_staleness;
+} sync_metrics_t;
+
+/**
+ * Get statistics about auto-sync.
+ */
+sync_metrics_t get_sync_metrics(void);
+
 #    define SYNC_NEVER ((uint32_t)~0)
 
+// Not intended to be used by users -> no docstring
+// evaluates to 0, fails to build if chunk offsets (16 bits) can't cover the variable
+#    define SYNC_CHECK_SIZE(variable) (0 * sizeof(struct { STATIC_ASSERT(sizeof(variable) <= UINT16_MAX, "Variable is too big for auto-sync"); int dummy; }))
+
+#    define SYNC_SHADOW_SIZE(variable, ms_rate) (SYNC_CHECK_SIZE(variable) + (((ms_rate) == SYNC_NEVER || sizeof(variable) > SYNC_MAX_PAYLOAD_SIZE) ? sizeof(variable) : 1))
+
+// How many bytes of a variable synced upon change are hashed on each housekeeping, bigger ones take several of them.
+#    ifndef SYNC_HASH_BYTES_PER_TASK
+#        define SYNC_HASH_BYTES_PER_TASK (128)
+#    endif
+
+// How many chunks of a large variable are sent on each housekeeping.
+#    ifndef SYNC_CHUNKS_PER_TASK
+#        define SYNC_CHUNKS_PER_TASK (1)
+#    endif
+
+// How many bytes (at most) are sent on each housekeeping, pending values over it wait for the next one.
+#    ifndef SYNC_TASK_BUDGET
+#        define SYNC_TASK_BUDGET (2 * RPC_M2S_BUFFER_SIZE)
+#    endif
+
+// How often (in milliseconds) master asks for slave's values, if it had nothing to send.
+#    ifndef SYNC_POLL_INTERVAL
+#        define SYNC_POLL_INTERVAL (20)
+#    endif
+
 /**
- * Synch a variable on a timely basis.
+ * Synch a variable, written by the side(s) in ``dir``.
+ *
+ * Optionally, a ``.priority`` can be given. When several values are pending, higher priorities are sent first (then,
+ * the ones waiting for the longest time). Default is ``0``.
+ *
+ * .. code-block:: c
+ *
+ *     const sync_config_t PROGMEM sync_configs[] = {
+ *         SYNC_ENTRY(slave_encoder, SYNC_NEVER, SYNC_S2M),
+ *         SYNC_ENTRY(layer_state, SYNC_NEVER, SYNC_M2S, .priority = 10),
+ *     };
+ *
+ * .. hint::
+ *    At most ``SYNC_TASK_BUDGET`` bytes are sent on each housekeeping, so that a burst of changes does not stall a
+ *    scan. Values over it wait for the next one.
  */
-#    define SYNC_TIMER(variable, ms_rate)     \
-        {                                     \
-            .slice =                          \
-                {                             \
-                    .addr = &(variable),      \
-                    .size = sizeof(variable), \
-                },                            \
-            .rate = (ms_rate),                \
+#    define SYNC_ENTRY(variable, ms_rate, dir, ...)                         \
+        {                                                                   \
+            .slice =                                                        \
+                {                                                           \
+                    .addr = &(variable),                                    \
+                    .size = sizeof(variable),                               \
+                },                                                          \
+            .rate      = (ms_rate),                                         \
+            .shadow    = (uint8_t[SYNC_SHADOW_SIZE(variable, ms_rate)]){0}, \
+            .direction = (dir),                                             \
+            __VA_ARGS__                                                     \
         }
 
+/**
+ * Synch a variable on a timely basis.
+ */
+#    define SYNC_TIMER(variable, ms_rate, ...) SYNC_ENTRY(variable, ms_rate, SYNC_M2S, ##__VA_ARGS__)
+
 /**
  * Synch a variable upon its value changing.
  */
-#    define SYNC_CHANGE(variable) SYNC_TIMER(variable, SYNC_NEVER)
+#    define SYNC_CHANGE(variable, ...) SYNC_TIMER(variable, SYNC_NEVER, ##__VA_ARGS__)
 
 // Not intended to be used by users -> no docstring
 uint8_t sync_configs_count(void);
@@ -6,6 +6,8 @@
 #ifdef AUTO_SYNC_ENABLE
 #    define NUM_SYNC_CONFIGS_RAW ARRAY_SIZE(sync_configs)
 
+STATIC_ASSERT(NUM_SYNC_CONFIGS_RAW <= SYNC_CONFIG_ID_FLAG, "Too many auto-sync entries, they would not have an ID");
+
 uint8_t sync_configs_count(void) {
     return NUM_SYNC_CONFIGS_RAW;
 }
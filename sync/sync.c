@@ -5,25 +5,664 @@
 
 #include <string.h>
 
-static void sync_handler(uint8_t m2s_size, const void *m2s_buffer, uint8_t s2m_size, void *s2m_buffer) {
-    memory_view_t *view = (memory_view_t *)m2s_buffer;
-    memcpy(view->slice.addr, &view->value, view->slice.size);
+#include "atomic_util.h"
+
+STATIC_ASSERT(SYNC_MAX_PAYLOAD_SIZE <= UINT8_MAX, "Offsets in delta runs would overflow");
+STATIC_ASSERT(SYNC_REGISTRY_SIZE <= SYNC_CONFIG_ID_FLAG, "Registry IDs would clash with auto-sync ones");
+
+// responses start with their length
+#define SYNC_S2M_CAPACITY (RPC_S2M_BUFFER_SIZE - 1)
+
+//
+// Registry
+//
+
+static struct {
+    memory_slice_t slice;
+    // a message for it was lost, slave's copy is unknown
+    bool resend;
+} registry[SYNC_REGISTRY_SIZE] = {0};
+
+int sync_register(uint8_t id, void *addr, size_t size) {
+    if (id >= SYNC_REGISTRY_SIZE || addr == NULL) {
+        return -EINVAL;
+    }
+
+    registry[id].slice = (memory_slice_t){
+        .addr = addr,
+        .size = size,
+    };
+    registry[id].resend = false;
+
+    return 0;
 }
 
-void sync_variable(void *addr, size_t size) {
-    // data is too big, can't send it
-    if (size > SYNC_MAX_PAYLOAD_SIZE) return;
-
-    memory_view_t view = {
-        .slice =
-            {
-                .addr = addr,
-                .size = size,
-            },
+int sync_unregister(uint8_t id) {
+    if (id >= SYNC_REGISTRY_SIZE) {
+        return -EINVAL;
+    }
+
+    registry[id].slice  = (memory_slice_t){0};
+    registry[id].resend = false;
+
+    return 0;
+}
+
+// where the variable with `id` lives on this side, NULL address if it is not registered
+static memory_slice_t registry_get(uint8_t id) {
+    if (id >= SYNC_REGISTRY_SIZE) {
+        return (memory_slice_t){0};
+    }
+
+    return registry[id].slice;
+}
+
+// ID under which `addr` was registered, -ENOENT if it wasn't
+static int registry_find(const void *addr) {
+    if (addr == NULL) {
+        return -ENOENT;
+    }
+
+    for (size_t i = 0; i < SYNC_REGISTRY_SIZE; ++i) {
+        if (registry[i].slice.addr == addr) {
+            return i;
+        }
+    }
+
+    return -ENOENT;
+}
+
+#ifdef AUTO_SYNC_ENABLE
+extern sync_state_t auto_sync_states[];
+
+// FNV-1a, can be computed in several steps
+#    define HASH_INIT (2166136261)
+
+static uint32_t hash_update(uint32_t hash, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 16777619;
+    }
+
+    return hash;
+}
+
+static uint32_t hash_value(const void *data, size_t size) {
+    return hash_update(HASH_INIT, data, size);
+}
+
+// hash (some more of) the value of an entry into `state->next_hash`
+// large variables take several calls, to not stall a single housekeeping. returns whether the hash is complete
+static bool hash_step(const sync_config_t *config, sync_state_t *state) {
+    const uint8_t *const bytes = config->slice.addr;
+
+    if (state->hashed == 0) {
+        state->next_hash = HASH_INIT;
+    }
+
+    const size_t size = MIN(config->slice.size - state->hashed, SYNC_HASH_BYTES_PER_TASK);
+    state->next_hash  = hash_update(state->next_hash, &bytes[state->hashed], size);
+    state->hashed += size;
+
+    if (state->hashed < config->slice.size) return false;
+
+    state->hashed = 0;
+    return true;
+}
+
+static struct {
+    sync_metrics_t values;
+    uint32_t       window_start;
+    uint32_t       window_bytes;
+    uint32_t       task_bytes;
+} metrics = {0};
+
+sync_metrics_t get_sync_metrics(void) {
+    return metrics.values;
+}
+
+static void update_metrics(void) {
+    const uint32_t elapsed = timer_elapsed32(metrics.window_start);
+    if (elapsed < 1000) return;
+
+    metrics.values.bytes_per_second = metrics.window_bytes * 1000 / elapsed;
+    metrics.window_bytes            = 0;
+    metrics.window_start            = timer_read32();
+}
+
+// entry of `sync_configs` with `id`, NULL if there is no such entry
+static sync_state_t *find_config(uint8_t id, sync_config_t *config) {
+    if (!(id & SYNC_CONFIG_ID_FLAG)) return NULL;
+
+    const size_t index = id & ~SYNC_CONFIG_ID_FLAG;
+    if (index >= sync_configs_count()) return NULL;
+
+    *config = get_sync_config(index);
+    return &auto_sync_states[index];
+}
+
+// ID of the entry owning `state`
+static uint8_t config_id(const sync_state_t *state) {
+    return SYNC_CONFIG_ID_FLAG | (state - auto_sync_states);
+}
+
+// mirrors SYNC_SHADOW_SIZE
+static bool has_shadow(const sync_config_t *config) {
+    return config->rate == SYNC_NEVER || config->slice.size > SYNC_MAX_PAYLOAD_SIZE;
+}
+
+// 0 is used for messages without version (ie: not from auto-sync), and to resynchronize the counters
+static uint8_t next_version(uint8_t version) {
+    return version == UINT8_MAX ? 1 : version + 1;
+}
+
+// version of the next message for an entry, restored by the caller if it doesn't get sent
+static uint8_t bump_version(sync_state_t *state) {
+    // both sides start counting again, the other one may have been reset
+    if (state->resync) {
+        state->version = 0;
+    } else {
+        state->version = next_version(state->version);
+    }
+
+    return state->version;
+}
+
+// whether a (versioned) message for an entry is newer than its current value
+// if both sides changed the value at once, master's write wins
+static bool is_newer(uint8_t version, const sync_state_t *state) {
+    if (version == 0) return true;
+
+    const int8_t diff = version - state->version;
+    return diff > 0 || (diff == 0 && !is_keyboard_master());
+}
+
+// value was written by the other side, don't send it back
+static void received(const sync_config_t *config, sync_state_t *state, uint8_t version) {
+    // 0 means that the other side started counting again
+    state->version = version;
+
+    state->hash = hash_value(config->slice.addr, config->slice.size);
+
+    // not ours to send anymore, and a hash in progress would mix both values
+    state->pending = false;
+    state->hashed  = 0;
+
+    if (has_shadow(config)) {
+        memcpy(config->shadow, config->slice.addr, config->slice.size);
+    }
+}
+#endif
+
+// a message for the variable with `id` was lost, its next one must contain the whole value
+static void mark_lost(uint8_t id) {
+    if (id < SYNC_REGISTRY_SIZE) {
+        registry[id].resend = true;
+        return;
+    }
+
+#ifdef AUTO_SYNC_ENABLE
+    sync_config_t       config;
+    sync_state_t *const state = find_config(id, &config);
+    if (state != NULL) {
+        state->resend = true;
+    }
+#endif
+}
+
+// shadow copies (and hashes) were updated when queueing the messages in `buffer`, flag them to be sent again
+static void mark_all_lost(const uint8_t *buffer, size_t len) {
+    size_t pos = 0;
+
+    while (pos + sizeof(sync_header_t) <= len) {
+        sync_header_t header;
+        memcpy(&header, &buffer[pos], sizeof(header));
+        pos += sizeof(header) + header.size;
+
+        if (header.op != SYNC_OP_LOST) {
+            mark_lost(header.id);
+        }
+    }
+}
+
+// slave-only, messages on the latest response, until master tells whether it got them
+static struct {
+    uint8_t buffer[SYNC_S2M_CAPACITY];
+    size_t  len;
+} in_flight = {0};
+
+//
+// Receiving
+//
+
+#ifdef AUTO_SYNC_ENABLE
+static void batch_drop(uint8_t id);
+#endif
+
+// patch the runs in `buffer` into `slice`
+static void delta_apply(const memory_slice_t *slice, const uint8_t *buffer, size_t size) {
+    uint8_t *const addr = slice->addr;
+
+    size_t pos = 0;
+
+    while (pos + sizeof(sync_run_t) <= size) {
+        sync_run_t run;
+        memcpy(&run, &buffer[pos], sizeof(run));
+        pos += sizeof(run);
+
+        // registered with a different size on each side
+        if (run.offset + run.size > slice->size) return;
+
+        memcpy(&addr[run.offset], &buffer[pos], run.size);
+        pos += run.size;
+    }
+}
+
+#ifdef AUTO_SYNC_ENABLE
+// chunks are stored on the shadow copy, until they have all been received
+static void chunk_apply(const sync_config_t *config, const uint8_t *buffer, size_t size) {
+    sync_chunk_t chunk;
+    memcpy(&chunk, buffer, sizeof(chunk));
+
+    const size_t len = size - sizeof(chunk);
+    if (chunk.offset + len > config->slice.size) return;
+
+    memcpy(&config->shadow[chunk.offset], &buffer[sizeof(chunk)], len);
+}
+#endif
+
+static void handle_message(const sync_header_t *header, const uint8_t *payload) {
+    memory_slice_t slice = registry_get(header->id);
+
+#ifdef AUTO_SYNC_ENABLE
+    sync_config_t       config;
+    sync_state_t *const state = find_config(header->id, &config);
+
+    if (state != NULL) {
+        slice = config.slice;
+    }
+
+    // chunks go to the shadow copy, version is checked upon commit
+    const bool versioned = state != NULL && header->op != SYNC_OP_CHUNK;
+
+    // outdated, other side has written a newer value (only one side writes the rest, always apply them)
+    if (versioned && config.direction == SYNC_BOTH && !is_newer(header->version, state)) return;
+#endif
+
+    // not registered on this side
+    if (slice.addr == NULL) return;
+
+    switch (header->op) {
+        case SYNC_OP_FULL:
+            // registered with a different size on each side
+            if (header->size != slice.size) return;
+
+            memcpy(slice.addr, payload, header->size);
+            break;
+
+        case SYNC_OP_DELTA:
+            delta_apply(&slice, payload, header->size);
+            break;
+
+#ifdef AUTO_SYNC_ENABLE
+        case SYNC_OP_CHUNK:
+            if (state != NULL) {
+                chunk_apply(&config, payload, header->size);
+            }
+            break;
+
+        case SYNC_OP_COMMIT: // all chunks received, update the variable
+            if (state != NULL) {
+                memcpy(config.slice.addr, config.shadow, config.slice.size);
+            }
+            break;
+#endif
+    }
+
+#ifdef AUTO_SYNC_ENABLE
+    if (versioned) {
+        received(&config, state, header->version);
+
+        // queued before the counters started over, would overwrite master's value with an older one
+        if (header->version == 0 && !is_keyboard_master()) {
+            batch_drop(header->id);
+        }
+    }
+#endif
+}
+
+// a transaction contains one or more messages, handle them in order
+static void handle_messages(const uint8_t *buffer, size_t size) {
+    size_t pos = 0;
+
+    while (pos + sizeof(sync_header_t) <= size) {
+        sync_header_t header;
+        memcpy(&header, &buffer[pos], sizeof(header));
+        pos += sizeof(header);
+
+        // truncated message
+        if (pos + header.size > size) return;
+
+        if (header.op == SYNC_OP_LOST) {
+            // master didn't get our previous response, send its values again
+            mark_all_lost(in_flight.buffer, in_flight.len);
+            in_flight.len = 0;
+        } else {
+            handle_message(&header, &buffer[pos]);
+        }
+
+        pos += header.size;
+    }
+}
+
+//
+// Sending
+//
+
+// master sends its messages when batch gets full (or closed)
+// slave keeps them until master asks for them, on the response of its next transaction
+static struct {
+    uint8_t buffer[MAX(RPC_M2S_BUFFER_SIZE, SYNC_S2M_CAPACITY)];
+    size_t  len;
+    bool    open;
+} batch = {0};
+
+// messages are built here, then appended to the batch
+static uint8_t scratch[RPC_M2S_BUFFER_SIZE];
+
+static uint32_t last_exchange = 0;
+
+// whether last transaction succeeded, false on boot
+static bool linked = false;
+
+// master-only, slave's response to the last transaction may have been lost, next one has to tell it
+static bool response_lost = false;
+
+static size_t batch_capacity(void) {
+    if (!is_keyboard_master()) {
+        return SYNC_S2M_CAPACITY;
+    }
+
+    // room for the notice, which goes first on the next transaction
+    return RPC_M2S_BUFFER_SIZE - (response_lost ? sizeof(sync_header_t) : 0);
+}
+
+#ifdef AUTO_SYNC_ENABLE
+// link (re)established, slave may have been reset meanwhile: send every variable both sides write again, with the
+// version counters starting over. otherwise, a side that restarted counting would have its values rejected
+static void resync(void) {
+    for (size_t i = 0; i < sync_configs_count(); ++i) {
+        if (get_sync_config(i).direction != SYNC_BOTH) continue;
+
+        auto_sync_states[i].resync = true;
+        auto_sync_states[i].resend = true;
+    }
+}
+#else
+#    define resync()
+#endif
+
+// master-only, also handles whatever slave sends back
+static void batch_send(void) {
+    uint8_t response[RPC_S2M_BUFFER_SIZE] = {0};
+
+    // slave keeps track of its last response until it hears back, room for this was kept in the batch
+    if (response_lost) {
+        const sync_header_t notice = {
+            .op = SYNC_OP_LOST,
+        };
+
+        memmove(&batch.buffer[sizeof(notice)], batch.buffer, batch.len);
+        memcpy(batch.buffer, &notice, sizeof(notice));
+        batch.len += sizeof(notice);
+    }
+
+    const bool ok = transaction_rpc_exec(ELPEKENIN_SYNC_ID, batch.len, batch.buffer, sizeof(response), response);
+
+    if (ok && !linked) {
+        resync();
+    }
+    linked        = ok;
+    response_lost = !ok;
+
+    if (ok) {
+        handle_messages(&response[1], MIN(response[0], SYNC_S2M_CAPACITY));
+    } else {
+        mark_all_lost(batch.buffer, batch.len);
+    }
+
+    batch.len = 0;
+
+    last_exchange = timer_read32();
+}
+
+static void batch_flush(void) {
+    if (!is_keyboard_master() || batch.len == 0) return;
+
+    batch_send();
+}
+
+// get room for a message with (up to) `size` bytes of payload, returns where payload has to be written
+static uint8_t *batch_reserve(size_t size) {
+    // even if empty, the batch may be full due to the room kept for a notice
+    if (batch.len + sizeof(sync_header_t) + size > batch_capacity() && is_keyboard_master()) {
+        batch_send();
+    }
+
+    return &scratch[sizeof(sync_header_t)];
+}
+
+#ifdef AUTO_SYNC_ENABLE
+// remove the messages for the variable with `id` from the batch
+static void batch_drop(uint8_t id) {
+    size_t pos = 0;
+
+    while (pos + sizeof(sync_header_t) <= batch.len) {
+        sync_header_t header;
+        memcpy(&header, &batch.buffer[pos], sizeof(header));
+
+        const size_t total = sizeof(header) + header.size;
+
+        if (header.id == id) {
+            memmove(&batch.buffer[pos], &batch.buffer[pos + total], batch.len - pos - total);
+            batch.len -= total;
+        } else {
+            pos += total;
+        }
+    }
+}
+#endif
+
+// payload has been written, add the message to the batch
+// returns whether it fit, slave can't make room until master asks for its messages
+static bool batch_commit(sync_op_t op, uint8_t version, uint8_t id, size_t size) {
+    const sync_header_t header = {
+        .op      = op,
+        .version = version,
+        .id      = id,
+        .size    = size,
     };
-    memcpy(view.value, addr, size);
+    memcpy(scratch, &header, sizeof(header));
+
+    const size_t total = sizeof(header) + size;
+
+    bool fits;
+    // on slave, the batch is taken by the handler, which may run at any point
+    ATOMIC_BLOCK_FORCEON {
+        fits = batch.len + total <= batch_capacity();
+        if (fits) {
+            memcpy(&batch.buffer[batch.len], scratch, total);
+            batch.len += total;
+        }
+    }
+
+#ifdef AUTO_SYNC_ENABLE
+    if (fits) {
+        metrics.window_bytes += total;
+        metrics.task_bytes += total;
+    }
+#endif
+
+    if (fits && !batch.open) {
+        batch_flush();
+    }
+
+    return fits;
+}
+
+void sync_batch_begin(void) {
+    batch.open = true;
+}
+
+void sync_batch_end(void) {
+    batch.open = false;
+    batch_flush();
+}
+
+static bool queue_full(uint8_t id, void *addr, size_t size, uint8_t version) {
+    // data is too big, can't send it
+    if (size > SYNC_MAX_PAYLOAD_SIZE) return false;
+
+    uint8_t *const payload = batch_reserve(size);
+    memcpy(payload, addr, size);
+
+    return batch_commit(SYNC_OP_FULL, version, id, size);
+}
+
+int sync_variable(void *addr, size_t size) {
+    const int id = registry_find(addr);
+    if (id < 0) {
+        return id;
+    }
+
+    if (size > SYNC_MAX_PAYLOAD_SIZE) {
+        return -E2BIG;
+    }
+
+    return queue_full(id, addr, size, 0) ? 0 : -ENOSPC;
+}
+
+// write the runs of bytes in which `value` and `shadow` differ into `buffer`
+// returns the size used, or `size` if it wouldn't be smaller (ie: better to send the whole value)
+static size_t delta_encode(const uint8_t *value, const uint8_t *shadow, size_t size, uint8_t *buffer) {
+    size_t len = 0;
+    size_t pos = 0;
 
-    transaction_rpc_send(ELPEKENIN_SYNC_ID, sizeof(memory_slice_t) + size, &view);
+    while (pos < size) {
+        // skip unchanged bytes
+        if (value[pos] == shadow[pos]) {
+            pos++;
+            continue;
+        }
+
+        // extend the run while bytes differ, or the gap is too small to be worth a new run
+        size_t end = pos + 1;
+        size_t gap = 0;
+        while (end + gap < size && gap <= sizeof(sync_run_t)) {
+            if (value[end + gap] != shadow[end + gap]) {
+                end += gap + 1;
+                gap = 0;
+            } else {
+                gap++;
+            }
+        }
+
+        const sync_run_t run = {
+            .offset = pos,
+            .size   = end - pos,
+        };
+
+        if (len + sizeof(run) + run.size >= size) return size;
+
+        memcpy(&buffer[len], &run, sizeof(run));
+        len += sizeof(run);
+
+        memcpy(&buffer[len], &value[pos], run.size);
+        len += run.size;
+
+        pos = end;
+    }
+
+    return len;
+}
+
+static bool queue_delta(uint8_t id, void *addr, void *shadow, size_t size, uint8_t version) {
+    // data is too big, can't send it
+    if (size > SYNC_MAX_PAYLOAD_SIZE) return false;
+
+    // room for the worst case, sending it whole
+    uint8_t *const payload = batch_reserve(size);
+
+    const size_t len = delta_encode(addr, shadow, size, payload);
+
+    // nothing changed
+    if (len == 0) return true;
+
+    bool fits;
+    if (len >= size) {
+        memcpy(payload, addr, size);
+        fits = batch_commit(SYNC_OP_FULL, version, id, size);
+    } else {
+        fits = batch_commit(SYNC_OP_DELTA, version, id, len);
+    }
+
+    if (fits) {
+        memcpy(shadow, addr, size);
+    }
+
+    return fits;
+}
+
+int sync_variable_delta(void *addr, void *shadow, size_t size) {
+    const int id = registry_find(addr);
+    if (id < 0) {
+        return id;
+    }
+
+    if (size > SYNC_MAX_PAYLOAD_SIZE) {
+        return -E2BIG;
+    }
+
+    // previous message was lost, send it whole (cleared beforehand, a new loss sets it again)
+    const bool full     = registry[id].resend;
+    registry[id].resend = false;
+
+    bool sent;
+    if (full) {
+        sent = queue_full(id, addr, size, 0);
+        if (sent) {
+            memcpy(shadow, addr, size);
+        }
+    } else {
+        sent = queue_delta(id, addr, shadow, size, 0);
+    }
+
+    if (!sent) {
+        registry[id].resend |= full;
+    }
+
+    return sent ? 0 : -ENOSPC;
+}
+
+static void sync_handler(uint8_t m2s_size, const void *m2s_buffer, uint8_t s2m_size, void *s2m_buffer) {
+    handle_messages(m2s_buffer, m2s_size);
+
+    if (s2m_size == 0) return;
+
+    // piggyback pending messages on the response
+    // no locking: housekeeping can't preempt the transport
+    uint8_t *const response = s2m_buffer;
+    const size_t   len      = MIN(batch.len, (size_t)(s2m_size - 1));
+
+    response[0] = len;
+    memcpy(&response[1], batch.buffer, len);
+
+    // kept until master's next transaction, which tells if it didn't get them
+    memcpy(in_flight.buffer, batch.buffer, len);
+    in_flight.len = len;
+
+    batch.len = 0;
 }
 
 void keyboard_post_init_sync(void) {
@@ -31,32 +670,267 @@ void keyboard_post_init_sync(void) {
 }
 
 #ifdef AUTO_SYNC_ENABLE
-extern sync_state_t auto_sync_states[];
+// entry's pending value has been sent
+static void mark_sent(sync_state_t *state) {
+    const uint32_t staleness = timer_elapsed32(state->deadline);
+
+    metrics.values.worst_staleness = MAX(metrics.values.worst_staleness, staleness);
+    state->pending                 = false;
+}
+
+// send the next chunks of a large variable, and the commit once all of them are sent
+static void send_chunks(const sync_config_t *config, sync_state_t *state) {
+    for (size_t i = 0; i < SYNC_CHUNKS_PER_TASK; ++i) {
+        const size_t left = config->slice.size - state->offset;
+        const size_t size = MIN(left, SYNC_MAX_PAYLOAD_SIZE - sizeof(sync_chunk_t));
+
+        const sync_chunk_t chunk = {
+            .offset = state->offset,
+        };
+
+        // sent from the shadow copy, variable may change meanwhile
+        uint8_t *const payload = batch_reserve(sizeof(chunk) + size);
+        memcpy(payload, &chunk, sizeof(chunk));
+        memcpy(&payload[sizeof(chunk)], &config->shadow[state->offset], size);
+
+        // no room (link is down), try again on next housekeeping
+        if (!batch_commit(SYNC_OP_CHUNK, state->version, config_id(state), sizeof(chunk) + size)) return;
+
+        // hash of the value being sent, built along the way
+        state->next_hash = hash_update(state->next_hash, &config->shadow[state->offset], size);
+        state->offset += size;
+
+        // a chunk was lost, transfer starts over on next housekeeping
+        if (state->resend) return;
+
+        if (state->offset == config->slice.size) {
+            // may send the last chunks, don't commit if they get lost
+            batch_reserve(0);
+            if (state->resend) return;
+
+            if (!batch_commit(SYNC_OP_COMMIT, state->version, config_id(state), 0)) return;
+
+            state->hash   = state->next_hash;
+            state->resync = false;
+
+            state->sending = false;
+            mark_sent(state);
+            return;
+        }
+    }
+}
+
+// take a copy of the value and start sending it in chunks
+static void start_chunks(const sync_config_t *config, sync_state_t *state) {
+    memcpy(config->shadow, config->slice.addr, config->slice.size);
+
+    bump_version(state);
+    state->offset    = 0;
+    state->sending   = true;
+    state->next_hash = HASH_INIT;
+
+    send_chunks(config, state);
+}
+
+// queue the value of a small entry (or only its changes), returns whether there was room for it
+static bool send_value(const sync_config_t *config, sync_state_t *state, bool delta) {
+    // bumped beforehand, a response being handled meanwhile can't overwrite the new value
+    const uint8_t previous = state->version;
+    const uint8_t version  = bump_version(state);
+
+    bool sent;
+    if (delta) {
+        sent = queue_delta(config_id(state), config->slice.addr, config->shadow, config->slice.size, version);
+    } else {
+        sent = queue_full(config_id(state), config->slice.addr, config->slice.size, version);
+    }
+
+    if (sent) {
+        state->resync = false;
+    } else {
+        state->version = previous;
+    }
+
+    // whole value was sent, copy is now up to date
+    if (sent && !delta && has_shadow(config)) {
+        memcpy(config->shadow, config->slice.addr, config->slice.size);
+    }
+
+    return sent;
+}
+
+// whether an entry has something to send, sets its deadline when it becomes pending
+static bool is_pending(const sync_config_t *config, sync_state_t *state, bool master) {
+    // written by the other side
+    if (!(config->direction & (master ? SYNC_M2S : SYNC_S2M))) return false;
+
+    // transfer in progress, keep going
+    if (state->sending) return true;
+
+    // slave can only send values fitting on a single response
+    if (!master && config->slice.size + sizeof(sync_header_t) > SYNC_S2M_CAPACITY) return false;
+
+    // last message was lost, send it again regardless of rate/changes
+    if (state->resend) {
+        if (!state->pending) {
+            state->deadline = timer_read32();
+        }
+
+        return true;
+    }
+
+    const bool on_change = config->rate == SYNC_NEVER;
+    if (on_change) {
+        // change found earlier, still waiting to be sent (eg: out of budget)
+        if (state->pending) return true;
+
+        // hash not complete yet, or value hasn't changed
+        if (!hash_step(config, state) || state->next_hash == state->hash) return false;
+
+        // from now on, it is getting stale
+        state->deadline = timer_read32();
+        return true;
+    }
+
+    // last sync is recent
+    if (timer_elapsed32(state->last_update) <= config->rate) return false;
+
+    state->deadline = state->last_update + config->rate;
+    return true;
+}
+
+// send (or start sending) the value of an entry
+static void send_entry(const sync_config_t *config, sync_state_t *state) {
+    // transfer in progress, keep going
+    if (state->sending) {
+        // a chunk was lost, start over (slave would commit a corrupt value otherwise)
+        if (state->resend) {
+            state->resend = false;
+            start_chunks(config, state);
+            return;
+        }
+
+        send_chunks(config, state);
+        return;
+    }
+
+    const bool large     = config->slice.size > SYNC_MAX_PAYLOAD_SIZE;
+    const bool on_change = config->rate == SYNC_NEVER;
+
+    // last message was lost, send the whole value (cleared beforehand, a new loss sets it again)
+    const bool full = state->resend;
+    state->resend   = false;
+
+    if (on_change) {
+        // computed when the change was found. on a resend there is none, keeping the old one means that a later change
+        // is still detected (at worst, an unchanged value gets an empty delta)
+        const uint32_t hash = full ? state->hash : state->next_hash;
+
+        // hash is computed while sending, the value may change meanwhile
+        if (large) {
+            start_chunks(config, state);
+            return;
+        }
+
+        // only send what changed since last time (also updates the copy)
+        // unless both sides write: the other one may have changed bytes that are not in the delta
+        const bool delta = !full && config->direction != SYNC_BOTH;
+        if (send_value(config, state, delta)) {
+            state->hash = hash;
+            mark_sent(state);
+        } else {
+            state->resend |= full;
+        }
+        return;
+    }
+
+    if (large) {
+        state->last_update = timer_read32();
+        start_chunks(config, state);
+        return;
+    }
+
+    if (send_value(config, state, false)) {
+        state->last_update = timer_read32();
+        mark_sent(state);
+    } else {
+        state->resend |= full;
+    }
+}
+
+// highest priority first, then oldest deadline
+static bool goes_before(uint8_t priority, const sync_state_t *state, uint8_t other_priority, const sync_state_t *other) {
+    if (priority != other_priority) return priority > other_priority;
+
+    return (int32_t)(state->deadline - other->deadline) < 0;
+}
+
+// pending entry to be sent next, NULL if none is left
+static sync_state_t *next_entry(sync_config_t *config) {
+    sync_state_t *best = NULL;
+
+    for (size_t i = 0; i < sync_configs_count(); ++i) {
+        sync_state_t *const state = &auto_sync_states[i];
+        if (!state->pending || state->tried) continue;
+
+        const sync_config_t candidate = get_sync_config(i);
+
+        if (best == NULL || goes_before(candidate.priority, state, config->priority, best)) {
+            best    = state;
+            *config = candidate;
+        }
+    }
+
+    return best;
+}
 
 void housekeeping_task_sync(void) {
-    if (!is_keyboard_master()) return;
+    const bool master = is_keyboard_master();
+    bool       poll   = false;
 
+    // find out what has to be sent
     for (size_t i = 0; i < sync_configs_count(); ++i) {
         const sync_config_t config = get_sync_config(i);
         sync_state_t *const state  = &auto_sync_states[i];
 
-        const bool on_change = config.rate == SYNC_NEVER;
-        if (on_change) {
-            // value hasn't changed
-            if (memcmp(&state->value, config.slice.addr, config.slice.size) == 0) {
-                continue;
-            }
+        if (master && (config.direction & SYNC_S2M)) {
+            poll = true;
+        }
 
-            memcpy(&state->value, config.slice.addr, config.slice.size);
-        } else {
-            // last sync is recent
-            if (timer_elapsed32(state->last_update) <= config.rate) {
-                continue;
-            }
-            state->last_update = timer_read32();
+        state->pending = is_pending(&config, state, master);
+        state->tried   = false;
+    }
+
+    // changes are sent together, as few transactions as possible
+    sync_batch_begin();
+    metrics.task_bytes = 0;
+
+    // send by priority until running out of budget, the rest is left for next time
+    // at least one entry is handled every time, regardless of the budget
+    sync_config_t config;
+    sync_state_t *state;
+    while ((state = next_entry(&config)) != NULL) {
+        if (metrics.task_bytes > 0 && metrics.task_bytes >= SYNC_TASK_BUDGET) {
+            break;
+        }
+
+        send_entry(&config, state);
+        state->tried = true;
+    }
+
+    // count entries left for next time
+    for (size_t i = 0; i < sync_configs_count(); ++i) {
+        if (auto_sync_states[i].pending && !auto_sync_states[i].tried) {
+            metrics.values.deferred++;
         }
+    }
 
-        sync_variable(config.slice.addr, config.slice.size);
+    // nothing sent for a while, ask slave for its changes
+    if (poll && batch.len == 0 && timer_elapsed32(last_exchange) >= SYNC_POLL_INTERVAL) {
+        batch_send();
     }
+
+    sync_batch_end();
+    update_metrics();
 }
 #endif